@@ -4,16 +4,36 @@
 #include <Library/UefiRuntimeServicesTableLib.h>
 #include <Library/MemoryAllocationLib.h>
 #include <Library/UefiLib.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/PrintLib.h>
 #include <Protocol/GraphicsOutput.h>
 #include <Protocol/SimpleFileSystem.h>
 #include <Protocol/SimplePointer.h>
+#include <Protocol/ShellParameters.h>
 
 CONST unsigned SCREEN_WIDTH = 1024, SCREEN_HEIGHT = 768; //or 800x600
 CONST unsigned TILE_SIZE = 40;
 CONST int PLAYER_SPEED = 6, JUMP_SPEED = 6, FALL_SPEED = 2;
 CONST int PLAYER_JUMP_DURATION = 25;
 CONST int ANIMATION_DURATION = 3;
-CONST int MONEY_ANIMATION_DURATION = 5;
+CONST unsigned MAX_PARTICLES = 32768;
+CONST int PARTICLE_PRECISION = 8;			//Particle positions and velocities are fixed point numbers with 8 fractional bits.
+CONST int PARTICLE_GRAVITY = 24;			//In 1/256 of a pixel per tick.
+CONST unsigned PARTICLE_SIZE = 3;
+CONST unsigned COIN_PARTICLES = 48;
+CONST unsigned DEATH_PARTICLES = 600;
+CONST int DEATH_EFFECT_DURATION = 60;		//Number of ticks the death effect is shown before the player respawns.
+CONST unsigned SNAPSHOT_INTERVAL = 15;		//Number of ticks between two snapshots of the game state.
+CONST unsigned SNAPSHOTS_PER_KEYFRAME = 8;	//Number of snapshots stored as changes to the same keyframe.
+CONST unsigned KEYFRAME_COUNT = 8;
+CONST unsigned RESPAWN_SNAPSHOTS = 3;		//Number of snapshots the game goes back when the player dies.
+CONST unsigned GOLDEN_DUMP_INTERVAL = 50;	//Every n-th frame of a recorded golden run is saved as a bitmap.
+CONST unsigned TIMER_CALIBRATION_TICKS = 8;	//Number of timer events used to measure the timer period at startup.
+CONST unsigned RENDER_BUDGET_PERCENT = 80; 	//Part of the timer period that drawing and presenting one frame can take.
+CONST unsigned MAX_FRAME_SKIP = 8;			//Max number of timer ticks simulated without presenting a frame.
+CONST unsigned OVERLOAD_FRAMES = 30;		//Number of frames over the budget in a row that lowers the render quality.
+CONST unsigned RECOVERY_FRAMES = 120;		//Number of cheap frames in a row that raises the render quality.
 
 
 void clearScreenWithColor(EFI_GRAPHICS_OUTPUT_PROTOCOL* Screen, UINT8 red, UINT8 green, UINT8 blue){
@@ -38,10 +58,174 @@ void clearScreenWithColor(EFI_GRAPHICS_OUTPUT_PROTOCOL* Screen, UINT8 red, UINT8
 	);
 }
 
+//Kernels filling a row of pixels with one color and expanding a row of palette indices to colors.
+typedef void (*FillRowFunction)(UINT32 * dest, UINT32 color, UINTN count);
+typedef void (*ExpandRowFunction)(UINT32 * dest, CONST UINT8 * indices, CONST UINT32 * palette, UINTN count);
+
+void fillRowPortable(UINT32 * dest, UINT32 color, UINTN count){
+	SetMem32(dest, count * sizeof(UINT32), color);
+}
+void expandRowPortable(UINT32 * dest, CONST UINT8 * indices, CONST UINT32 * palette, UINTN count){
+	for(UINTN i = 0; i < count; i++){
+		dest[i] = palette[indices[i]];
+	}
+}
+
+//Vector kernels are written with GCC vector extensions, so they don't need intrinsic headers (which depend on the C library).
+//Every kernel is compiled for its own instruction set and chosen at startup with CPUID. The gather builtin is GCC-only, so clang uses the portable kernels.
+#if defined(MDE_CPU_X64) && defined(__GNUC__) && !defined(__clang__)
+typedef UINT32 Vec4Uint32 __attribute__((vector_size(16), aligned(4)));
+typedef UINT32 Vec8Uint32 __attribute__((vector_size(32), aligned(4)));
+typedef INT32 Vec8Int32 __attribute__((vector_size(32)));
+
+__attribute__((target("sse2"))) void fillRowSse2(UINT32 * dest, UINT32 color, UINTN count){
+	Vec4Uint32 colors = {color, color, color, color};
+	UINTN i = 0;
+	for(; i + 16 <= count; i += 16){
+		*(Vec4Uint32*)&dest[i] = colors;
+		*(Vec4Uint32*)&dest[i + 4] = colors;
+		*(Vec4Uint32*)&dest[i + 8] = colors;
+		*(Vec4Uint32*)&dest[i + 12] = colors;
+	}
+	for(; i + 4 <= count; i += 4){
+		*(Vec4Uint32*)&dest[i] = colors;
+	}
+	for(; i < count; i++){
+		dest[i] = color;
+	}
+}
+__attribute__((target("avx2"))) void fillRowAvx2(UINT32 * dest, UINT32 color, UINTN count){
+	Vec8Uint32 colors = {color, color, color, color, color, color, color, color};
+	UINTN i = 0;
+	for(; i + 32 <= count; i += 32){
+		*(Vec8Uint32*)&dest[i] = colors;
+		*(Vec8Uint32*)&dest[i + 8] = colors;
+		*(Vec8Uint32*)&dest[i + 16] = colors;
+		*(Vec8Uint32*)&dest[i + 24] = colors;
+	}
+	for(; i + 8 <= count; i += 8){
+		*(Vec8Uint32*)&dest[i] = colors;
+	}
+	for(; i < count; i++){
+		dest[i] = color;
+	}
+}
+//SSE2 has no gather instruction, so colors are read one by one and written 4 at a time.
+__attribute__((target("sse2"))) void expandRowSse2(UINT32 * dest, CONST UINT8 * indices, CONST UINT32 * palette, UINTN count){
+	UINTN i = 0;
+	for(; i + 4 <= count; i += 4){
+		Vec4Uint32 colors = {palette[indices[i]], palette[indices[i + 1]], palette[indices[i + 2]], palette[indices[i + 3]]};
+		*(Vec4Uint32*)&dest[i] = colors;
+	}
+	for(; i < count; i++){
+		dest[i] = palette[indices[i]];
+	}
+}
+//Read 8 colors from the palette with a single gather instruction.
+__attribute__((target("avx2"))) void expandRowAvx2(UINT32 * dest, CONST UINT8 * indices, CONST UINT32 * palette, UINTN count){
+	Vec8Int32 mask = {-1, -1, -1, -1, -1, -1, -1, -1};
+	Vec8Int32 zero = {0, 0, 0, 0, 0, 0, 0, 0};
+	UINTN i = 0;
+	for(; i + 8 <= count; i += 8){
+		Vec8Int32 colorIdx = {indices[i], indices[i + 1], indices[i + 2], indices[i + 3], indices[i + 4], indices[i + 5], indices[i + 6], indices[i + 7]};
+		*(Vec8Uint32*)&dest[i] = (Vec8Uint32)__builtin_ia32_gathersiv8si(zero, (CONST INT32*)palette, colorIdx, mask, 4);
+	}
+	for(; i < count; i++){
+		dest[i] = palette[indices[i]];
+	}
+}
+#endif
+
+//Part of the frame changed since the frame was last presented.
+typedef struct{
+	UINTN x, y;
+	UINTN width, height;
+} DirtyRectStruct;
+#define MAX_DIRTY_RECTS 64
+//Frame composed in memory. When the frame is presented, only its changed parts are sent to the screen, each with its own Blt.
+typedef struct{
+	EFI_GRAPHICS_OUTPUT_BLT_PIXEL * pixels;
+	unsigned width, height;
+	FillRowFunction fillRow;
+	ExpandRowFunction expandRow;
+	DirtyRectStruct dirtyRects[MAX_DIRTY_RECTS];
+	unsigned dirtyCount;
+	BOOLEAN isFullyDirty;	//Set if the whole frame must be presented, e.g. after clearing it or when there are too many dirty rectangles.
+} FrameStruct;
+//Choose the fastest kernels supported by the CPU.
+void setupFrameKernels(FrameStruct * Frame){
+	Frame->fillRow = fillRowPortable;
+	Frame->expandRow = expandRowPortable;
+#if defined(MDE_CPU_X64) && defined(__GNUC__) && !defined(__clang__)
+	UINT32 maxLeaf, ebx, ecx, edx;
+	AsmCpuid(0, &maxLeaf, NULL, NULL, NULL);
+	AsmCpuid(1, NULL, NULL, &ecx, &edx);
+	if(edx & BIT26){
+		Frame->fillRow = fillRowSse2;
+		Frame->expandRow = expandRowSse2;
+	}
+	//AVX registers can be used only if the firmware enabled saving their state (OSXSAVE and XCR0).
+	if(maxLeaf >= 7 && (ecx & BIT27) && (ecx & BIT28) && (AsmXGetBv(0) & 6) == 6){
+		AsmCpuidEx(7, 0, NULL, &ebx, NULL, NULL);
+		if(ebx & BIT5){
+			Frame->fillRow = fillRowAvx2;
+			Frame->expandRow = expandRowAvx2;
+		}
+	}
+#endif
+}
+//Remember a part of the frame that must be presented. The rectangle must be already clipped to the frame.
+void markFrameDirty(FrameStruct * Frame, UINTN x, UINTN y, UINTN width, UINTN height){
+	if(Frame->isFullyDirty){
+		return;
+	}
+	if(Frame->dirtyCount == MAX_DIRTY_RECTS){
+		Frame->isFullyDirty = TRUE;
+		return;
+	}
+	Frame->dirtyRects[Frame->dirtyCount++] = (DirtyRectStruct){x, y, width, height};
+}
+void clearFrameWithColor(FrameStruct * Frame, UINT8 red, UINT8 green, UINT8 blue){
+	//Pixel layout of EFI_GRAPHICS_OUTPUT_BLT_PIXEL: blue, green, red, reserved.
+	UINT32 color = (UINT32)blue | ((UINT32)green << 8) | ((UINT32)red << 16);
+	Frame->fillRow((UINT32*) Frame->pixels, color, Frame->width * Frame->height);
+	Frame->isFullyDirty = TRUE;
+}
+void presentFrame(EFI_GRAPHICS_OUTPUT_PROTOCOL* Screen, FrameStruct * Frame){
+	if(Frame->isFullyDirty){
+		Frame->dirtyRects[0] = (DirtyRectStruct){0, 0, Frame->width, Frame->height};
+		Frame->dirtyCount = 1;
+	}
+	for(unsigned i = 0; i < Frame->dirtyCount; i++){
+		DirtyRectStruct * Rect = &Frame->dirtyRects[i];
+		Screen->Blt(
+			Screen,														//*This - EFI_GRAPHICS_OUTPUT_PROTOCOL,
+			Frame->pixels,												//*BltBuffer, OPTIONAL
+			EfiBltBufferToVideo,										//BltOperation,
+			Rect->x, Rect->y,											//SourceX & SourceY,
+			Rect->x, Rect->y,											//DestinationX & DestinationY,
+			Rect->width, Rect->height,									//Width & Height,
+			Frame->width * sizeof(EFI_GRAPHICS_OUTPUT_BLT_PIXEL) 		//Delta, OPTIONAL - Length in bytes of a row in the frame.
+		);
+	}
+	Frame->dirtyCount = 0;
+	Frame->isFullyDirty = FALSE;
+}
+
+#define PALETTE_SIZE 256
+//Sprite stored as 8-bit indices into one of the palettes of its sprite array. Colors are expanded from the palette when the sprite is drawn.
+typedef struct{
+	UINT8 * pixels;			//Palette indices of all pixels. Palette swaps share them with the original sprite.
+	unsigned paletteIdx;
+	BOOLEAN ownsPixels;		//FALSE if the pixels belong to another sprite.
+} SpriteStruct;
 //Dynamic array of sprites for all game tiles and animations. 
 typedef struct {
-	//Array of arrays of pixels.
-	EFI_GRAPHICS_OUTPUT_BLT_PIXEL** sprites;
+	SpriteStruct * sprites;
+	UINT32 * palettes;		//Palettes with PALETTE_SIZE colors each, in the EFI_GRAPHICS_OUTPUT_BLT_PIXEL layout. Palette 0 has all colors of the bitmap.
+	unsigned spriteCount;
+	unsigned paletteCount;
+	unsigned width, height;	//Size of each sprite.
 } SpriteArray;
 
 //Size of the .bmp image header.
@@ -77,33 +261,124 @@ SpriteArray* loadSprites(EFI_FILE_PROTOCOL* RootDirectory, CHAR16* fileName, int
 	unsigned spriteNumber = width / spriteWidth;
 
 	//Allocate memory for all sprites that will be created by dividing the loaded bitmap into fragments with the same width and height.
-	NewSprites->sprites = AllocatePool(spriteNumber * sizeof(EFI_GRAPHICS_OUTPUT_BLT_PIXEL*));
+	//Only the palette of the whole bitmap is allocated here. Palettes of palette swaps are added when they are found.
+	NewSprites->sprites = AllocatePool(spriteNumber * sizeof(SpriteStruct));
+	NewSprites->palettes = AllocateZeroPool(PALETTE_SIZE * sizeof(UINT32));
+	NewSprites->spriteCount = spriteNumber;
+	NewSprites->paletteCount = 1;
+	NewSprites->width = spriteWidth;
+	NewSprites->height = spriteHeight;
+
+	UINT32 * colors = AllocatePool(spriteWidth * spriteHeight * sizeof(UINT32));
+	UINT32 swapPalette[PALETTE_SIZE];
+	BOOLEAN isColorSet[PALETTE_SIZE];
+	unsigned colorCount = 0;
 
 	unsigned spriteIdx, inPixelIdx = 0, outPixelIdx = 0, x, y;
 	//Copy pixel colors to all sprites.
 	for(spriteIdx = 0; spriteIdx < spriteNumber; spriteIdx++){
 		//Allocate memory for all pixels in a sprite.
-		NewSprites->sprites[spriteIdx] = AllocatePool(spriteWidth * spriteHeight * sizeof(EFI_GRAPHICS_OUTPUT_BLT_PIXEL));
+		SpriteStruct * Sprite = &NewSprites->sprites[spriteIdx];
+		Sprite->pixels = AllocatePool(spriteWidth * spriteHeight * sizeof(UINT8));
+		Sprite->paletteIdx = 0;
+		Sprite->ownsPixels = TRUE;
 		
-		//Copy pixel colors from the buffer to a new sprite.
+		//Copy pixel colors from the buffer to a new sprite and find their indices in the palette of the whole bitmap.
 		for(y = 0; y < spriteHeight; y++){
 			for(x = 0; x < spriteWidth; x++){
 				//Choose current input pixel by jumping every 3 pixels.
 				inPixelIdx = (spriteWidth - 1 - y) * 3 * width + 3 * x + 3 * spriteIdx * spriteWidth;
 				outPixelIdx = y * spriteWidth + x;
-				NewSprites->sprites[spriteIdx][outPixelIdx].Red = bitmapBuffer[inPixelIdx + 2];
-				NewSprites->sprites[spriteIdx][outPixelIdx].Green = bitmapBuffer[inPixelIdx + 1];
-				NewSprites->sprites[spriteIdx][outPixelIdx].Blue = bitmapBuffer[inPixelIdx + 0];
-				NewSprites->sprites[spriteIdx][outPixelIdx].Reserved = 0;
+				UINT32 color = (UINT8)bitmapBuffer[inPixelIdx + 0] | ((UINT8)bitmapBuffer[inPixelIdx + 1] << 8) | ((UINT8)bitmapBuffer[inPixelIdx + 2] << 16);
+				colors[outPixelIdx] = color;
+
+				unsigned colorIdx = 0;
+				while(colorIdx < colorCount && NewSprites->palettes[colorIdx] != color){
+					colorIdx++;
+				}
+				if(colorIdx == colorCount){
+					if(colorCount == PALETTE_SIZE){
+						Print(L"File \"%s\" has more than %d colors.\n", fileName, PALETTE_SIZE);
+						*imageStatus = FALSE;
+						colorIdx = 0;
+					}
+					else{
+						NewSprites->palettes[colorCount++] = color;
+					}
+				}
+				Sprite->pixels[outPixelIdx] = (UINT8)colorIdx;
+			}
+		}
+
+		//If the sprite differs from an earlier one only by colors, use the pixels of the earlier sprite with a new palette.
+		for(unsigned otherIdx = 0; otherIdx < spriteIdx; otherIdx++){
+			SpriteStruct * Other = &NewSprites->sprites[otherIdx];
+			if(!Other->ownsPixels){
+				continue;
+			}
+			SetMem(isColorSet, sizeof(isColorSet), FALSE);
+			for(outPixelIdx = 0; outPixelIdx < spriteWidth * spriteHeight; outPixelIdx++){
+				UINT8 colorIdx = Other->pixels[outPixelIdx];
+				if(isColorSet[colorIdx] && swapPalette[colorIdx] != colors[outPixelIdx]){
+					break;
+				}
+				swapPalette[colorIdx] = colors[outPixelIdx];
+				isColorSet[colorIdx] = TRUE;
+			}
+			if(outPixelIdx == spriteWidth * spriteHeight){
+				FreePool(Sprite->pixels);
+				Sprite->pixels = Other->pixels;
+				Sprite->ownsPixels = FALSE;
+				NewSprites->palettes = ReallocatePool(NewSprites->paletteCount * PALETTE_SIZE * sizeof(UINT32), (NewSprites->paletteCount + 1) * PALETTE_SIZE * sizeof(UINT32), NewSprites->palettes);
+				Sprite->paletteIdx = NewSprites->paletteCount++;
+				CopyMem(&NewSprites->palettes[Sprite->paletteIdx * PALETTE_SIZE], swapPalette, sizeof(swapPalette));
+				break;
 			}
 		}
 	}
 	
 	SpriteFile->Close(SpriteFile);
+	FreePool(colors);
 	FreePool(bitmapBuffer);
 	return NewSprites;
 }
 
+//Add a palette swap of the sprite: a new sprite with the same pixels and the fromColor replaced by the toColor. Returns the index of the new sprite.
+unsigned addPaletteSwap(SpriteArray * Sprites, unsigned spriteIdx, UINT8 fromRed, UINT8 fromGreen, UINT8 fromBlue, UINT8 toRed, UINT8 toGreen, UINT8 toBlue){
+	UINT32 fromColor = (UINT32)fromBlue | ((UINT32)fromGreen << 8) | ((UINT32)fromRed << 16);
+	UINT32 toColor = (UINT32)toBlue | ((UINT32)toGreen << 8) | ((UINT32)toRed << 16);
+
+	Sprites->sprites = ReallocatePool(Sprites->spriteCount * sizeof(SpriteStruct), (Sprites->spriteCount + 1) * sizeof(SpriteStruct), Sprites->sprites);
+	Sprites->palettes = ReallocatePool(Sprites->paletteCount * PALETTE_SIZE * sizeof(UINT32), (Sprites->paletteCount + 1) * PALETTE_SIZE * sizeof(UINT32), Sprites->palettes);
+
+	SpriteStruct * Original = &Sprites->sprites[spriteIdx];
+	UINT32 * palette = &Sprites->palettes[Sprites->paletteCount * PALETTE_SIZE];
+	CopyMem(palette, &Sprites->palettes[Original->paletteIdx * PALETTE_SIZE], PALETTE_SIZE * sizeof(UINT32));
+	for(unsigned i = 0; i < PALETTE_SIZE; i++){
+		if(palette[i] == fromColor){
+			palette[i] = toColor;
+		}
+	}
+
+	SpriteStruct * Swap = &Sprites->sprites[Sprites->spriteCount];
+	Swap->pixels = Original->pixels;
+	Swap->paletteIdx = Sprites->paletteCount;
+	Swap->ownsPixels = FALSE;
+	Sprites->paletteCount++;
+	return Sprites->spriteCount++;
+}
+
+void freeSprites(SpriteArray * Sprites){
+	for(unsigned i = 0; i < Sprites->spriteCount; i++){
+		if(Sprites->sprites[i].ownsPixels){
+			FreePool(Sprites->sprites[i].pixels);
+		}
+	}
+	FreePool(Sprites->sprites);
+	FreePool(Sprites->palettes);
+	FreePool(Sprites);
+}
+
 typedef struct{
 	int x, y;
 } vec2i;
@@ -112,7 +387,7 @@ vec2i rvec2i(int x, int y){
 }
 
 enum ObjectType{
-	null, green_brick, red_brick, mossy_brick, web, spider, coin, player
+	null, green_brick, red_brick, mossy_brick, web, spider, coin, player, patrolling_spider, climbing_spider
 };
 typedef struct{
 	vec2i pos;
@@ -155,6 +430,251 @@ void setupPlayer(PlayerStruct * Player, vec2i pos, int frameIdx){
 	Player->coins = 0;
 }
 
+//Fixed size pool of particles stored as a structure of arrays, so updating them is a few simple loops over integers.
+//Dead particles are removed by moving the last particle in their place, so living particles are always at the beginning of the arrays.
+typedef struct{
+	INT32 * x;				//Position in the level in 1/256 of a pixel.
+	INT32 * y;
+	INT32 * velocityX;		//Velocity in 1/256 of a pixel per tick.
+	INT32 * velocityY;
+	INT32 * lifetime;		//Number of ticks left before the particle disappears.
+	UINT32 * color;			//Color in the EFI_GRAPHICS_OUTPUT_BLT_PIXEL layout.
+	unsigned count;
+	unsigned capacity;
+	UINT32 seed;			//State of the random number generator used for emitting particles.
+} ParticlePoolStruct;
+EFI_STATUS setupParticlePool(ParticlePoolStruct * Particles, unsigned capacity){
+	Particles->x = AllocatePool(capacity * sizeof(INT32));
+	Particles->y = AllocatePool(capacity * sizeof(INT32));
+	Particles->velocityX = AllocatePool(capacity * sizeof(INT32));
+	Particles->velocityY = AllocatePool(capacity * sizeof(INT32));
+	Particles->lifetime = AllocatePool(capacity * sizeof(INT32));
+	Particles->color = AllocatePool(capacity * sizeof(UINT32));
+	if(Particles->x == NULL || Particles->y == NULL || Particles->velocityX == NULL || Particles->velocityY == NULL
+		|| Particles->lifetime == NULL || Particles->color == NULL
+	){
+		return EFI_OUT_OF_RESOURCES;
+	}
+	Particles->count = 0;
+	Particles->capacity = capacity;
+	Particles->seed = 2463534242;
+	return EFI_SUCCESS;
+}
+void freeParticlePool(ParticlePoolStruct * Particles){
+	FreePool(Particles->x);
+	FreePool(Particles->y);
+	FreePool(Particles->velocityX);
+	FreePool(Particles->velocityY);
+	FreePool(Particles->lifetime);
+	FreePool(Particles->color);
+}
+//Xorshift random number generator.
+UINT32 nextRandom(UINT32 * seed){
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 17;
+	*seed ^= *seed << 5;
+	return *seed;
+}
+//Emit a burst of particles flying in random directions from the center (in pixels). If the pool is full, the rest of the burst is dropped.
+void emitParticles(ParticlePoolStruct * Particles, vec2i center, unsigned amount, UINT8 red, UINT8 green, UINT8 blue, int speed, int lifetime){
+	UINT32 color = (UINT32)blue | ((UINT32)green << 8) | ((UINT32)red << 16);
+	if(amount > Particles->capacity - Particles->count){
+		amount = Particles->capacity - Particles->count;
+	}
+	for(unsigned i = Particles->count; i < Particles->count + amount; i++){
+		Particles->x[i] = center.x << PARTICLE_PRECISION;
+		Particles->y[i] = center.y << PARTICLE_PRECISION;
+		Particles->velocityX[i] = (int)(nextRandom(&Particles->seed) % (2 * speed + 1)) - speed;
+		Particles->velocityY[i] = (int)(nextRandom(&Particles->seed) % (2 * speed + 1)) - speed - speed / 2;
+		Particles->lifetime[i] = lifetime / 2 + (int)(nextRandom(&Particles->seed) % (lifetime / 2 + 1));
+		Particles->color[i] = color;
+	}
+	Particles->count += amount;
+}
+void updateParticles(ParticlePoolStruct * Particles){
+	unsigned count = Particles->count;
+
+	//Each loop works on whole arrays without branches, so the compiler can use vector instructions.
+	for(unsigned i = 0; i < count; i++){
+		Particles->velocityY[i] += PARTICLE_GRAVITY;
+	}
+	for(unsigned i = 0; i < count; i++){
+		Particles->x[i] += Particles->velocityX[i];
+		Particles->y[i] += Particles->velocityY[i];
+	}
+	for(unsigned i = 0; i < count; i++){
+		Particles->lifetime[i]--;
+	}
+
+	//Remove dead particles by moving the last living particle in their place.
+	for(unsigned i = 0; i < count;){
+		if(Particles->lifetime[i] > 0){
+			i++;
+			continue;
+		}
+		count--;
+		Particles->x[i] = Particles->x[count];
+		Particles->y[i] = Particles->y[count];
+		Particles->velocityX[i] = Particles->velocityX[count];
+		Particles->velocityY[i] = Particles->velocityY[count];
+		Particles->lifetime[i] = Particles->lifetime[count];
+		Particles->color[i] = Particles->color[count];
+	}
+	Particles->count = count;
+}
+
+//Render quality levels. Each level drops more work from drawing a frame when the video output is too slow.
+//Frames that don't need clearing present only the parts that were redrawn, so the dropped work also makes presenting cheaper.
+enum RenderQuality{
+	render_full, render_no_hud_refresh, render_no_animation
+};
+//Render governor measures how long drawing and presenting a frame takes (in CPU timestamp counter ticks)
+//and lowers the render quality when this time doesn't fit in the timer period. It also counts timer ticks with the timestamp
+//counter, because timer events signaled while a frame is drawn and presented are merged into one event.
+typedef struct{
+	UINT64 tickPeriod;			//Measured time between two timer events.
+	UINT64 budget;				//Max time of drawing and presenting one frame.
+	UINT64 drawCost;			//Smoothed time of drawing one frame.
+	UINT64 presentCost;			//Smoothed time of presenting one frame.
+	UINT64 lastTickTime;		//Time of the last simulated timer tick.
+	unsigned overloadFrames;	//Number of frames over the budget in a row.
+	unsigned underloadFrames;	//Number of frames below half of the budget in a row.
+	enum RenderQuality quality;
+} RenderGovernorStruct;
+void setupRenderGovernor(RenderGovernorStruct * Governor, EFI_EVENT TimerEvent){
+	UINTN eventId;
+
+	//Measure the timer period. It differs between virtual machines and real hardware.
+	gBS->WaitForEvent(1, &TimerEvent, &eventId);
+	UINT64 startTime = AsmReadTsc();
+	for(unsigned i = 0; i < TIMER_CALIBRATION_TICKS; i++){
+		gBS->WaitForEvent(1, &TimerEvent, &eventId);
+	}
+	Governor->tickPeriod = DivU64x32(AsmReadTsc() - startTime, TIMER_CALIBRATION_TICKS);
+	if(Governor->tickPeriod == 0){
+		Governor->tickPeriod = 1;
+	}
+	Governor->budget = DivU64x32(MultU64x32(Governor->tickPeriod, RENDER_BUDGET_PERCENT), 100);
+	if(Governor->budget == 0){
+		Governor->budget = 1;
+	}
+
+	Governor->drawCost = 0;
+	Governor->presentCost = 0;
+	Governor->lastTickTime = AsmReadTsc();
+	Governor->overloadFrames = 0;
+	Governor->underloadFrames = 0;
+	Governor->quality = render_full;
+}
+//Returns the number of timer ticks that passed since the last simulated tick. The game simulates all of them before drawing
+//the next frame, so a slow frame doesn't slow down the game.
+unsigned countDueTicks(RenderGovernorStruct * Governor){
+	UINT64 now = AsmReadTsc();
+	UINT64 dueTicks = 0;
+	if(now > Governor->lastTickTime){
+		dueTicks = DivU64x64Remainder(now - Governor->lastTickTime, Governor->tickPeriod, NULL);
+	}
+	//The timer event came a bit early, or the game was waiting for something else (e.g. for a key) and doesn't have to catch up.
+	if(dueTicks == 0 || dueTicks > MAX_FRAME_SKIP){
+		Governor->lastTickTime = now;
+		return dueTicks == 0 ? 1 : MAX_FRAME_SKIP;
+	}
+	//The rest of the elapsed time is kept for the next tick.
+	Governor->lastTickTime += MultU64x32(Governor->tickPeriod, (UINT32)dueTicks);
+	return (unsigned)dueTicks;
+}
+void updateRenderGovernor(RenderGovernorStruct * Governor, UINT64 drawCost, UINT64 presentCost){
+	//Smooth measured costs, so a single slow frame doesn't change the render quality.
+	Governor->drawCost = DivU64x32(MultU64x32(Governor->drawCost, 7) + drawCost, 8);
+	Governor->presentCost = DivU64x32(MultU64x32(Governor->presentCost, 7) + presentCost, 8);
+	UINT64 frameCost = Governor->drawCost + Governor->presentCost;
+
+	if(frameCost > Governor->budget){
+		Governor->underloadFrames = 0;
+		Governor->overloadFrames++;
+		if(Governor->overloadFrames >= OVERLOAD_FRAMES && Governor->quality < render_no_animation){
+			Governor->quality++;
+			Governor->overloadFrames = 0;
+		}
+		return;
+	}
+
+	Governor->overloadFrames = 0;
+	if(frameCost < Governor->budget / 2){
+		Governor->underloadFrames++;
+		if(Governor->underloadFrames >= RECOVERY_FRAMES && Governor->quality > render_full){
+			Governor->quality--;
+			Governor->underloadFrames = 0;
+		}
+	}
+	else{
+		Governor->underloadFrames = 0;
+	}
+}
+
+//Animation of an object type: sprites shown one after another and the number of ticks each of them is shown.
+//Types with less than 2 frames are not animated. Adding frames here (e.g. for webs) animates all objects of the type.
+#define MAX_ANIMATION_FRAMES 8
+typedef struct{
+	unsigned frameCount;
+	int frames[MAX_ANIMATION_FRAMES];
+	unsigned durations[MAX_ANIMATION_FRAMES];
+} AnimationStruct;
+CONST AnimationStruct ANIMATIONS[] = {
+	[coin] = {8, {0, 1, 2, 3, 4, 5, 6, 7}, {6, 6, 6, 6, 6, 6, 6, 6}},
+	[patrolling_spider] = {2, {0, 2}, {40, 4}},	//Spiders blink from time to time.
+	[climbing_spider] = {2, {1, 2}, {40, 4}}
+};
+
+//Animated objects are kept in a timer wheel - a ring of slots with lists of objects whose next frame is due on the tick of the slot.
+//Each tick only objects from a single slot are checked, so objects waiting for their next frame cost nothing.
+#define ANIMATION_WHEEL_SIZE 64
+typedef struct{
+	ObjectStruct * Object;
+	unsigned step;			//Index of the current frame in the animation of the object type.
+	UINT32 dueTick;			//Tick of the next frame. Objects with durations longer than the wheel wait for more than one round.
+	int next;				//Next object in the same slot. -1 ends the list.
+	BOOLEAN isChanged;		//Set if the object changed since the last drawn frame.
+} AnimatedObjectStruct;
+typedef struct{
+	AnimatedObjectStruct * objects;
+	unsigned objectCount;
+	int slots[ANIMATION_WHEEL_SIZE];
+	unsigned * changed;		//Indices of objects changed since the last drawn frame.
+	unsigned changedCount;
+	UINT32 tick;
+} AnimationWheelStruct;
+
+//Enemies move every tick, turn back when they hit a solid block or the level border and kill the player on contact.
+//Their starting velocity comes from the level file (see ENEMY_SPEED in levelMaker.py).
+typedef struct{
+	ObjectStruct Base;
+	vec2i velocity;
+} EnemyStruct;
+
+//Snapshot of the game state stored as the words that differ from the keyframe of its group.
+#define MAX_SNAPSHOT_CHANGES 64
+typedef struct{
+	UINT16 changeCount;		//MAX_SNAPSHOT_CHANGES + 1 if the snapshot had too many changes and wasn't saved.
+	UINT16 wordIdx[MAX_SNAPSHOT_CHANGES];
+	UINT32 value[MAX_SNAPSHOT_CHANGES];
+} SnapshotStruct;
+//Fixed size ring buffer of game state snapshots used for respawning and rewinding. The game state is the player,
+//the camera, the enemies with their order and one bit for each block telling if it's active. The ring is divided
+//into KEYFRAME_COUNT groups and the first snapshot of each group is saved whole as the keyframe of the group.
+typedef struct{
+	SnapshotStruct * snapshots;
+	UINT32 * keyframes;
+	UINT32 * initialState;		//Game state at the start of the level used for restarting the level.
+	UINT32 * state;				//Buffer for the current game state.
+	unsigned stateWords;
+	unsigned blockCount;
+	unsigned enemyCount;
+	unsigned next;				//Slot for the next snapshot.
+	unsigned count;				//Number of saved snapshots before the next slot.
+	unsigned timer;				//Number of ticks left before the next snapshot.
+} SnapshotRingStruct;
+
 typedef struct{
 	EFI_SIMPLE_FILE_SYSTEM_PROTOCOL * SimpleFileSystemProtocol;
 	EFI_FILE_PROTOCOL * RootDirectory;
@@ -165,16 +685,27 @@ typedef struct{
 	SpriteArray * CastleSprites;
 	SpriteArray * Font;
 	SpriteArray * CursorSprite;
+	SpriteArray * SpiderSprites;
 	EFI_SIMPLE_POINTER_PROTOCOL * Mouse;
 	EFI_EVENT TimerEvent;
 	EFI_EVENT events[3];
 	BOOLEAN quit;
 	BOOLEAN died;
-	int coinsAnimationTime;
+	unsigned deathEffectTime;	//Number of ticks left of the death effect. The game is paused while it plays.
 	int mouseX, mouseY;
 	BOOLEAN showMouseCursor;
 	BOOLEAN isMouseMoving;
 	ObjectStruct * Blocks;
+	EnemyStruct * Enemies;
+	unsigned * EnemyOrder;	//Indices of enemies sorted by their x position. Updated every tick.
+	unsigned * SolidOrder;	//Indices of solid blocks sorted by their x position. Blocks don't move, so it's sorted only once.
+	FrameStruct Frame;
+	RenderGovernorStruct Governor;
+	ParticlePoolStruct Particles;
+	AnimationWheelStruct Animations;
+	SnapshotRingStruct Snapshots;
+	BOOLEAN frameNeedsClear;	//Set when the camera or any object moved since the last drawn frame.
+	unsigned hudCoins;			//Score displayed in the last drawn frame.
 } GameStruct;
 EFI_STATUS setupGame(GameStruct * Game){
 	EFI_STATUS status;
@@ -241,6 +772,13 @@ EFI_STATUS setupGame(GameStruct * Game){
 	if(!imageStatus){
 		return EFI_ABORTED;
 	}
+	Game->SpiderSprites = loadSprites(Game->RootDirectory, L"images\\spider.bmp", TILE_SIZE, TILE_SIZE, &imageStatus);
+	if(!imageStatus){
+		return EFI_ABORTED;
+	}
+	//Spiders patrolling vertically have yellow eyes (sprite 1) and blinking spiders have black eyes (sprite 2). They share pixels with the original sprite.
+	addPaletteSwap(Game->SpiderSprites, 0, 255, 0, 0, 255, 255, 0);
+	addPaletteSwap(Game->SpiderSprites, 0, 255, 0, 0, 0, 0, 0);
 
 	//Locate EFI_SIMPLE_POINTER_PROTOCOL used to read from the mouse driver. (Running this game doesn't require a mouse driver nor an actual mouse.)
 	status = gBS->LocateProtocol(
@@ -254,6 +792,25 @@ EFI_STATUS setupGame(GameStruct * Game){
 		return EFI_ABORTED;
 	}
 
+	//Allocate memory for the frame composed before presenting it on the screen.
+	Game->Frame.width = SCREEN_WIDTH;
+	Game->Frame.height = SCREEN_HEIGHT;
+	Game->Frame.dirtyCount = 0;
+	Game->Frame.isFullyDirty = TRUE;
+	setupFrameKernels(&Game->Frame);
+	Game->Frame.pixels = AllocatePool(SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(EFI_GRAPHICS_OUTPUT_BLT_PIXEL));
+	if(Game->Frame.pixels == NULL){
+		Print(L"Error: Not enough memory for the frame buffer. Press any key to continue.\n");
+		gBS->WaitForEvent(1, &gST->ConIn->WaitForKey, &eventId);
+		return EFI_ABORTED;
+	}
+
+	if(EFI_ERROR(setupParticlePool(&Game->Particles, MAX_PARTICLES))){
+		Print(L"Error: Not enough memory for particles. Press any key to continue.\n");
+		gBS->WaitForEvent(1, &gST->ConIn->WaitForKey, &eventId);
+		return EFI_ABORTED;
+	}
+
 	//Create timer event for timing the game execution.
 	gBS->CreateEvent(
 		EVT_TIMER,			//Type,
@@ -279,36 +836,45 @@ EFI_STATUS setupGame(GameStruct * Game){
 
 	Game->quit = 0;
 	Game->died = 0;
-	Game->coinsAnimationTime = MONEY_ANIMATION_DURATION;
+	Game->deathEffectTime = 0;
+	Game->Animations.objects = NULL;
 	Game->mouseX = 0;
 	Game->mouseY = 0;
 	Game->showMouseCursor = FALSE;
 	Game->isMouseMoving = FALSE;
+	Game->frameNeedsClear = TRUE;
+	Game->hudCoins = 0;
+
+	setupRenderGovernor(&Game->Governor, Game->TimerEvent);
 
 	return EFI_SUCCESS;
 }
 void freeAllocatedMemory(GameStruct * Game){
 	FreePool(Game->Blocks);
-	for(UINT16 i = 0; i < 12; i++){
-		FreePool(Game->PlayerSprites->sprites[i]);
-	}
-	FreePool(Game->PlayerSprites);
-	for(UINT16 i = 0; i < 5; i++){
-		FreePool(Game->BlocksSprites->sprites[i]);
-	}
-	FreePool(Game->BlocksSprites);
-	for(UINT16 i = 0; i < 8; i++){
-		FreePool(Game->CoinSprites->sprites[i]);
+	if(Game->Enemies != NULL){
+		FreePool(Game->Enemies);
+		FreePool(Game->EnemyOrder);
 	}
-	FreePool(Game->CoinSprites);
-	for(UINT16 i = 0; i < 16; i++){
-		FreePool(Game->CastleSprites->sprites[i]);
+	if(Game->SolidOrder != NULL){
+		FreePool(Game->SolidOrder);
 	}
-	FreePool(Game->CastleSprites);
-	for(UINT16 i = 0; i < 10; i++){
-		FreePool(Game->Font->sprites[i]);
+	freeSprites(Game->PlayerSprites);
+	freeSprites(Game->BlocksSprites);
+	freeSprites(Game->CoinSprites);
+	freeSprites(Game->CastleSprites);
+	freeSprites(Game->Font);
+	freeSprites(Game->CursorSprite);
+	freeSprites(Game->SpiderSprites);
+	FreePool(Game->Frame.pixels);
+	freeParticlePool(&Game->Particles);
+	if(Game->Animations.objects != NULL){
+		FreePool(Game->Animations.objects);
+		FreePool(Game->Animations.changed);
 	}
-	FreePool(Game->Font);
+	FreePool(Game->Snapshots.snapshots);
+	FreePool(Game->Snapshots.keyframes);
+	FreePool(Game->Snapshots.initialState);
+	FreePool(Game->Snapshots.state);
 	Game->RootDirectory->Close(Game->RootDirectory);
 }
 
@@ -316,77 +882,117 @@ typedef struct{
 	unsigned width; //Level width in pixels. Limits the camera movement.
 	unsigned height; //Level height in pixels. The player is killed when they fall out of the map (when this height is crossed). Level height limits the camera movement.
 	unsigned blockCount;
+	unsigned solidCount;
+	unsigned enemyCount;
 	vec2i castlePos;
 } LevelStruct;
+
+//Level files are made by levelMaker.py from text maps. Sections of the file are already in the layout of the game arrays,
+//so loading a level is a header check and reads straight into place. levelMaker.py --check validates the file offline.
+#define LEVEL_MAGIC 0x564C5055	//"UPLV"
+#define LEVEL_VERSION 1
+#define LEVEL_ALIGNMENT 8
+typedef struct{
+	UINT32 magic;
+	UINT32 version;				//Changed whenever the layout of the file or the game structures changes.
+	UINT32 headerSize;			//Sizes of the structures used to build the file. They must match the game.
+	UINT32 objectSize;
+	UINT32 enemySize;
+	UINT32 tileSize;
+	UINT32 width, height;		//Size of the map in the number of blocks.
+	UINT32 blockCount, solidCount, enemyCount;
+	UINT32 blocksOffset;		//Blocks (ObjectStruct) sorted row by row.
+	UINT32 solidOrderOffset;	//Indices of solid blocks sorted by their x position.
+	UINT32 enemiesOffset;		//Enemies (EnemyStruct) sorted by their x position.
+	vec2i spawnPos;
+	vec2i castlePos;
+	UINT32 fileSize;
+	UINT32 reserved[3];
+} LevelHeaderStruct;
+
+BOOLEAN isLevelSectionValid(LevelHeaderStruct * Header, UINT32 offset, UINT64 size, UINT64 * sectionsEnd){
+	if(offset % LEVEL_ALIGNMENT != 0 || offset < *sectionsEnd || offset + size > Header->fileSize){
+		return FALSE;
+	}
+	*sectionsEnd = offset + size;
+	return TRUE;
+}
+BOOLEAN isLevelHeaderValid(LevelHeaderStruct * Header){
+	if(Header->magic != LEVEL_MAGIC || Header->version != LEVEL_VERSION || Header->headerSize != sizeof(LevelHeaderStruct)
+		|| Header->objectSize != sizeof(ObjectStruct) || Header->enemySize != sizeof(EnemyStruct) || Header->tileSize != TILE_SIZE
+		|| Header->solidCount > Header->blockCount
+	){
+		return FALSE;
+	}
+	UINT64 sectionsEnd = Header->headerSize;
+	return isLevelSectionValid(Header, Header->blocksOffset, (UINT64)Header->blockCount * sizeof(ObjectStruct), &sectionsEnd)
+		&& isLevelSectionValid(Header, Header->solidOrderOffset, (UINT64)Header->solidCount * sizeof(unsigned), &sectionsEnd)
+		&& isLevelSectionValid(Header, Header->enemiesOffset, (UINT64)Header->enemyCount * sizeof(EnemyStruct), &sectionsEnd);
+}
+BOOLEAN readLevelSection(EFI_FILE_PROTOCOL * LevelFile, UINT32 offset, VOID * buffer, UINTN size){
+	if(size == 0){
+		return TRUE;
+	}
+	UINTN bufferSize = size;
+	if(buffer == NULL || EFI_ERROR(LevelFile->SetPosition(LevelFile, offset)) || EFI_ERROR(LevelFile->Read(LevelFile, &bufferSize, buffer))){
+		return FALSE;
+	}
+	return bufferSize == size;
+}
+
 //Highly modified version of @rubikshift 's "InitLevel" function.
 EFI_STATUS loadLevel(LevelStruct * Level, PlayerStruct * Player, GameStruct * Game, CHAR16 * levelName){
-	setupPlayer(Player, rvec2i(0, 0), 0);
-	Level->castlePos = rvec2i(600, 600);
-	
+	Game->Blocks = NULL;
+	Game->SolidOrder = NULL;
+	Game->Enemies = NULL;
+	Game->EnemyOrder = NULL;
+
 	EFI_FILE_PROTOCOL* LevelFile;
 	EFI_STATUS fileStatus = Game->RootDirectory->Open(Game->RootDirectory, &LevelFile, levelName, EFI_FILE_MODE_READ, 0);
 	if(EFI_ERROR(fileStatus)){
 		return EFI_ABORTED;
 	}
 
-	unsigned width, height;
-	UINTN bufferSize = sizeof(unsigned);
-	//Read from the file the width and height (in the number of blocks) of the current map.
-	LevelFile->Read(LevelFile, &bufferSize, (VOID*) &height);
-	LevelFile->Read(LevelFile, &bufferSize, (VOID*) &width);
+	LevelHeaderStruct Header;
+	if(!readLevelSection(LevelFile, 0, &Header, sizeof(LevelHeaderStruct)) || !isLevelHeaderValid(&Header)){
+		Print(L"Error: Unsupported level file. Rebuild it with levelMaker.py.\n");
+		LevelFile->Close(LevelFile);
+		return EFI_ABORTED;
+	}
 
-	//Read the max number of blocks used in the current map from the file.
-	LevelFile->Read(LevelFile, &bufferSize, (VOID*) &Level->blockCount);
-	
-	bufferSize = width * height * sizeof(CHAR8);
-	CHAR8* tileBuffer = AllocatePool(bufferSize);
+	setupPlayer(Player, Header.spawnPos, 0);
+	Level->castlePos = Header.castlePos;
+	Level->width = Header.width * TILE_SIZE;
+	Level->height = Header.height * TILE_SIZE;
+	Level->blockCount = Header.blockCount;
+	Level->solidCount = Header.solidCount;
+	Level->enemyCount = Header.enemyCount;
 
-	//Read the map layout from the file to a buffer. Each character read from the file corresponds to the type of a different object that exists on the map.
-	LevelFile->Read(LevelFile, &bufferSize, (VOID*) tileBuffer);
 	//Allocate memory for all blocks that will create the terrain of the map. This includes coins.
 	Game->Blocks = AllocatePool(sizeof(ObjectStruct) * Level->blockCount);
+	if(Level->solidCount > 0){
+		Game->SolidOrder = AllocatePool(sizeof(unsigned) * Level->solidCount);
+	}
+	if(Level->enemyCount > 0){
+		Game->Enemies = AllocatePool(sizeof(EnemyStruct) * Level->enemyCount);
+		Game->EnemyOrder = AllocatePool(sizeof(unsigned) * Level->enemyCount);
+	}
 
-	unsigned x, y, objIdx = 0;
-	for(unsigned bufferIdx = 0; bufferIdx < bufferSize; bufferIdx++){
-		x = bufferIdx % width;
-		y = bufferIdx / width;
-		if(tileBuffer[bufferIdx] == 'G'){ //Green brick
-			setupObject(&Game->Blocks[objIdx], rvec2i(x * TILE_SIZE, y * TILE_SIZE), green_brick, 0, TRUE, TRUE);
-			objIdx++;
-		}
-		else if(tileBuffer[bufferIdx] == 'R'){	//Red brick
-			setupObject(&Game->Blocks[objIdx], rvec2i(x * TILE_SIZE, y * TILE_SIZE), red_brick, 1, TRUE, TRUE);
-			objIdx++;
-		}
-		else if(tileBuffer[bufferIdx] == 'M'){ //Mossy red brick
-			setupObject(&Game->Blocks[objIdx], rvec2i(x * TILE_SIZE, y * TILE_SIZE), mossy_brick, 2, TRUE, TRUE);
-			objIdx++;
-		}
-		else if(tileBuffer[bufferIdx] == 'W'){ //Web - a trap that kills the player 
-			setupObject(&Game->Blocks[objIdx], rvec2i(x * TILE_SIZE, y * TILE_SIZE), web, 3, TRUE, TRUE);
-			objIdx++;
-		}
-		else if(tileBuffer[bufferIdx] == 'S'){ //Web with a spider - a trap that kills the player 
-			setupObject(&Game->Blocks[objIdx], rvec2i(x * TILE_SIZE, y * TILE_SIZE), spider, 4, TRUE, TRUE);
-			objIdx++;
-		}
-		else if(tileBuffer[bufferIdx] == 'C'){ //Coin - an animated collectable
-			setupObject(&Game->Blocks[objIdx], rvec2i(x * TILE_SIZE, y * TILE_SIZE), coin, 0, TRUE, FALSE);
-			objIdx++;
-		}
-		else if (tileBuffer[bufferIdx] == 'P'){ //Player spawn point
-			Player->Base.pos = rvec2i(x * TILE_SIZE, y * TILE_SIZE);
-		}
-		else if (tileBuffer[bufferIdx] == 'E'){	//Castle location - the end goal of the game
-			Level->castlePos = rvec2i(x * TILE_SIZE, y * TILE_SIZE);
-		}
+	//Blocks, the order of solid blocks and enemies are read straight into place.
+	BOOLEAN isRead = readLevelSection(LevelFile, Header.blocksOffset, Game->Blocks, sizeof(ObjectStruct) * Level->blockCount)
+		&& readLevelSection(LevelFile, Header.solidOrderOffset, Game->SolidOrder, sizeof(unsigned) * Level->solidCount)
+		&& readLevelSection(LevelFile, Header.enemiesOffset, Game->Enemies, sizeof(EnemyStruct) * Level->enemyCount);
+	LevelFile->Close(LevelFile);
+	if(!isRead || (Level->enemyCount > 0 && Game->EnemyOrder == NULL)){
+		Print(L"Error: Couldn't load the level.\n");
+		return EFI_ABORTED;
 	}
 
-	Level->width = width * TILE_SIZE;
-	Level->height = height * TILE_SIZE;
+	//Enemies in the file are already sorted by their x position.
+	for(unsigned i = 0; i < Level->enemyCount; i++){
+		Game->EnemyOrder[i] = i;
+	}
 
-	LevelFile->Close(LevelFile);
-	FreePool(tileBuffer);
 	return EFI_SUCCESS;
 }
 
@@ -394,39 +1000,195 @@ typedef struct{
 	vec2i pos;
 } CameraStruct;
 
-void drawBitmap(EFI_GRAPHICS_OUTPUT_PROTOCOL* Screen, EFI_GRAPHICS_OUTPUT_BLT_PIXEL* Bitmap, UINTN destX, UINTN destY, UINTN width, UINTN height){
-	//"The basic graphics operation in the EFI_GRAPHICS_OUTPUT_PROTOCOL is the Block Transfer or Blt. The Blt
-	//operation allows data to be read or written to the video adapter’s video memory." ~ UEFI Spec. 2.10., page 426.
+void packGameState(SnapshotRingStruct * Snapshots, UINT32 * state, GameStruct * Game, PlayerStruct * Player, CameraStruct * Camera){
+	CopyMem(state, Player, sizeof(PlayerStruct));
+	CopyMem((UINT8*)state + sizeof(PlayerStruct), Camera, sizeof(CameraStruct));
+	UINT32 * enemies = &state[(sizeof(PlayerStruct) + sizeof(CameraStruct)) / sizeof(UINT32)];
+	UINT32 * enemyOrder = &enemies[Snapshots->enemyCount * sizeof(EnemyStruct) / sizeof(UINT32)];
+	CopyMem(enemies, Game->Enemies, Snapshots->enemyCount * sizeof(EnemyStruct));
+	CopyMem(enemyOrder, Game->EnemyOrder, Snapshots->enemyCount * sizeof(unsigned));
+	UINT32 * activeBits = &enemyOrder[Snapshots->enemyCount];
+	for(unsigned i = 0; i < (Snapshots->blockCount + 31) / 32; i++){
+		activeBits[i] = 0;
+	}
+	for(unsigned i = 0; i < Snapshots->blockCount; i++){
+		activeBits[i / 32] |= (UINT32)Game->Blocks[i].isActive << (i % 32);
+	}
+}
+void unpackGameState(SnapshotRingStruct * Snapshots, UINT32 * state, GameStruct * Game, PlayerStruct * Player, CameraStruct * Camera){
+	CopyMem(Player, state, sizeof(PlayerStruct));
+	CopyMem(Camera, (UINT8*)state + sizeof(PlayerStruct), sizeof(CameraStruct));
+	UINT32 * enemies = &state[(sizeof(PlayerStruct) + sizeof(CameraStruct)) / sizeof(UINT32)];
+	UINT32 * enemyOrder = &enemies[Snapshots->enemyCount * sizeof(EnemyStruct) / sizeof(UINT32)];
+	CopyMem(Game->Enemies, enemies, Snapshots->enemyCount * sizeof(EnemyStruct));
+	CopyMem(Game->EnemyOrder, enemyOrder, Snapshots->enemyCount * sizeof(unsigned));
+	UINT32 * activeBits = &enemyOrder[Snapshots->enemyCount];
+	for(unsigned i = 0; i < Snapshots->blockCount; i++){
+		Game->Blocks[i].isActive = (activeBits[i / 32] >> (i % 32)) & 1;
+	}
 
-	//"Blt a rectangle of pixels on the graphics screen." ~ UEFI Spec. 2.10., page 432.
-	Screen->Blt(
-		Screen,											//*This - EFI_GRAPHICS_OUTPUT_PROTOCOL,
-		Bitmap,											//*BltBuffer, OPTIONAL
-		EfiBltBufferToVideo,							//BltOperation,
-		0, 0,											//SourceX & SourceY,
-		destX, destY,									//DestinationX & DestinationY,
-		width, height,									//Width & Height,
-		width * sizeof(EFI_GRAPHICS_OUTPUT_BLT_PIXEL) 	//Delta, OPTIONAL - Length in bytes of a row in the bitmap. Required if only a part of the bitmap is drawn.
-	);
+	//Effects and leftovers of the old state are not a part of the snapshot.
+	Game->died = 0;
+	Game->Particles.count = 0;
+	Game->frameNeedsClear = TRUE;
 }
-void drawGameObject(ObjectStruct * Object, EFI_GRAPHICS_OUTPUT_PROTOCOL* Screen, SpriteArray * Bitmap, CameraStruct * Camera){
-	//Don't draw objects outside the camera.
-	if(Object->type != player && (!Object->isActive || Object->pos.x > Camera->pos.x + SCREEN_WIDTH - TILE_SIZE
-		|| Object->pos.y > Camera->pos.y + SCREEN_HEIGHT - TILE_SIZE
-		|| Object->pos.x < Camera->pos.x || Object->pos.y < Camera->pos.y
-	)){
+
+//Allocate the ring buffer and save the current state as the start of the level.
+EFI_STATUS setupSnapshots(SnapshotRingStruct * Snapshots, GameStruct * Game, PlayerStruct * Player, CameraStruct * Camera, unsigned blockCount, unsigned enemyCount){
+	Snapshots->blockCount = blockCount;
+	Snapshots->enemyCount = enemyCount;
+	//Every enemy moves all the time, so with many enemies the snapshots have too many changes and only keyframes are used.
+	Snapshots->stateWords = (sizeof(PlayerStruct) + sizeof(CameraStruct) + enemyCount * (sizeof(EnemyStruct) + sizeof(unsigned))) / sizeof(UINT32)
+		+ (blockCount + 31) / 32;
+	if(Snapshots->stateWords > MAX_UINT16){
+		return EFI_UNSUPPORTED;		//Changed words are stored as 16-bit indices.
+	}
+	Snapshots->snapshots = AllocatePool(KEYFRAME_COUNT * SNAPSHOTS_PER_KEYFRAME * sizeof(SnapshotStruct));
+	Snapshots->keyframes = AllocatePool(KEYFRAME_COUNT * Snapshots->stateWords * sizeof(UINT32));
+	Snapshots->initialState = AllocatePool(Snapshots->stateWords * sizeof(UINT32));
+	Snapshots->state = AllocatePool(Snapshots->stateWords * sizeof(UINT32));
+	if(Snapshots->snapshots == NULL || Snapshots->keyframes == NULL || Snapshots->initialState == NULL || Snapshots->state == NULL){
+		return EFI_OUT_OF_RESOURCES;
+	}
+	Snapshots->next = 0;
+	Snapshots->count = 0;
+	Snapshots->timer = 0;
+	packGameState(Snapshots, Snapshots->initialState, Game, Player, Camera);
+	return EFI_SUCCESS;
+}
+
+//Save a snapshot every SNAPSHOT_INTERVAL ticks.
+void takeSnapshot(SnapshotRingStruct * Snapshots, GameStruct * Game, PlayerStruct * Player, CameraStruct * Camera){
+	if(Snapshots->timer > 0){
+		Snapshots->timer--;
 		return;
 	}
-	drawBitmap(Screen, Bitmap->sprites[Object->frameIdx], Object->pos.x - Camera->pos.x, Object->pos.y - Camera->pos.y, TILE_SIZE, TILE_SIZE);
+	Snapshots->timer = SNAPSHOT_INTERVAL;
+
+	unsigned slot = Snapshots->next;
+	UINT32 * keyframe = &Snapshots->keyframes[(slot / SNAPSHOTS_PER_KEYFRAME) * Snapshots->stateWords];
+	SnapshotStruct * Snapshot = &Snapshots->snapshots[slot];
+	packGameState(Snapshots, Snapshots->state, Game, Player, Camera);
+
+	if(slot % SNAPSHOTS_PER_KEYFRAME == 0){
+		//A new keyframe makes the snapshots of the group from the previous round useless.
+		CopyMem(keyframe, Snapshots->state, Snapshots->stateWords * sizeof(UINT32));
+		Snapshot->changeCount = 0;
+		if(Snapshots->count > (KEYFRAME_COUNT - 1) * SNAPSHOTS_PER_KEYFRAME){
+			Snapshots->count = (KEYFRAME_COUNT - 1) * SNAPSHOTS_PER_KEYFRAME;
+		}
+	}
+	else{
+		Snapshot->changeCount = 0;
+		for(unsigned i = 0; i < Snapshots->stateWords; i++){
+			if(Snapshots->state[i] == keyframe[i]){
+				continue;
+			}
+			if(Snapshot->changeCount == MAX_SNAPSHOT_CHANGES){
+				Snapshot->changeCount = MAX_SNAPSHOT_CHANGES + 1;
+				break;
+			}
+			Snapshot->wordIdx[Snapshot->changeCount] = i;
+			Snapshot->value[Snapshot->changeCount] = Snapshots->state[i];
+			Snapshot->changeCount++;
+		}
+	}
+
+	Snapshots->next = (slot + 1) % (KEYFRAME_COUNT * SNAPSHOTS_PER_KEYFRAME);
+	if(Snapshots->count < KEYFRAME_COUNT * SNAPSHOTS_PER_KEYFRAME){
+		Snapshots->count++;
+	}
 }
 
-void useKeyboardInput(PlayerStruct * Player, GameStruct * Game, CameraStruct * Camera){
-	EFI_INPUT_KEY key;
-	
-	//Read a pressed key from the keyboard driver.
-	gST->ConIn->ReadKeyStroke(gST->ConIn, &key);
-		
-	switch(key.ScanCode){
+//Go back by the given number of snapshots and restore the game state from the last of them. Restored snapshots are removed,
+//so rewinding again goes further back. Returns FALSE if there are no saved snapshots.
+BOOLEAN rewindSnapshots(SnapshotRingStruct * Snapshots, unsigned steps, GameStruct * Game, PlayerStruct * Player, CameraStruct * Camera){
+	unsigned ringSize = KEYFRAME_COUNT * SNAPSHOTS_PER_KEYFRAME;
+	while(Snapshots->count > 0){
+		unsigned slot = (Snapshots->next + ringSize - 1) % ringSize;
+		SnapshotStruct * Snapshot = &Snapshots->snapshots[slot];
+		Snapshots->next = slot;
+		Snapshots->count--;
+		if(Snapshot->changeCount > MAX_SNAPSHOT_CHANGES || (steps > 1 && Snapshots->count > 0)){
+			steps--;
+			continue;
+		}
+
+		CopyMem(Snapshots->state, &Snapshots->keyframes[(slot / SNAPSHOTS_PER_KEYFRAME) * Snapshots->stateWords], Snapshots->stateWords * sizeof(UINT32));
+		for(unsigned i = 0; i < Snapshot->changeCount; i++){
+			Snapshots->state[Snapshot->wordIdx[i]] = Snapshot->value[i];
+		}
+		unpackGameState(Snapshots, Snapshots->state, Game, Player, Camera);
+		Snapshots->timer = SNAPSHOT_INTERVAL;
+		return TRUE;
+	}
+	return FALSE;
+}
+
+//Restart the level without loading it again.
+void restartLevel(SnapshotRingStruct * Snapshots, GameStruct * Game, PlayerStruct * Player, CameraStruct * Camera){
+	unpackGameState(Snapshots, Snapshots->initialState, Game, Player, Camera);
+	Snapshots->next = 0;
+	Snapshots->count = 0;
+	Snapshots->timer = 0;
+}
+
+void drawBitmap(FrameStruct * Frame, SpriteArray * Sprites, unsigned spriteIdx, INTN destX, INTN destY){
+	INTN width = Sprites->width, height = Sprites->height;
+
+	//Clip the bitmap to the frame, so bitmaps crossing the frame border are drawn partially.
+	INTN firstX = destX < 0 ? -destX : 0;
+	INTN firstY = destY < 0 ? -destY : 0;
+	INTN lastX = destX + width > (INTN)Frame->width ? (INTN)Frame->width - destX : width;
+	INTN lastY = destY + height > (INTN)Frame->height ? (INTN)Frame->height - destY : height;
+	if(firstX >= lastX || firstY >= lastY){
+		return;
+	}
+
+	//Expand palette indices of the sprite to colors and write them to the frame row by row.
+	UINT8 * pixels = Sprites->sprites[spriteIdx].pixels;
+	UINT32 * palette = &Sprites->palettes[Sprites->sprites[spriteIdx].paletteIdx * PALETTE_SIZE];
+	for(INTN y = firstY; y < lastY; y++){
+		UINT32 * row = (UINT32*) &Frame->pixels[(destY + y) * Frame->width + destX + firstX];
+		Frame->expandRow(row, &pixels[y * width + firstX], palette, lastX - firstX);
+	}
+	markFrameDirty(Frame, destX + firstX, destY + firstY, lastX - firstX, lastY - firstY);
+}
+//Returns TRUE if any part of the object was drawn.
+BOOLEAN drawGameObject(ObjectStruct * Object, FrameStruct * Frame, SpriteArray * Bitmap, CameraStruct * Camera){
+	//Don't draw objects outside the camera. Objects crossing the camera border are clipped.
+	if(!Object->isActive || Object->pos.x >= Camera->pos.x + (int)SCREEN_WIDTH || Object->pos.y >= Camera->pos.y + (int)SCREEN_HEIGHT
+		|| Object->pos.x + (int)TILE_SIZE <= Camera->pos.x || Object->pos.y + (int)TILE_SIZE <= Camera->pos.y
+	){
+		return FALSE;
+	}
+	drawBitmap(Frame, Bitmap, Object->frameIdx, Object->pos.x - Camera->pos.x, Object->pos.y - Camera->pos.y);
+	return TRUE;
+}
+
+//Draw all particles as small squares filled directly in the frame.
+void drawParticles(ParticlePoolStruct * Particles, FrameStruct * Frame, CameraStruct * Camera){
+	int maxX = Frame->width - PARTICLE_SIZE, maxY = Frame->height - PARTICLE_SIZE;
+	UINT32 * pixels = (UINT32*) Frame->pixels;
+	for(unsigned i = 0; i < Particles->count; i++){
+		int screenX = (Particles->x[i] >> PARTICLE_PRECISION) - Camera->pos.x;
+		int screenY = (Particles->y[i] >> PARTICLE_PRECISION) - Camera->pos.y;
+		if(screenX < 0 || screenY < 0 || screenX > maxX || screenY > maxY){
+			continue;
+		}
+		UINT32 * row = &pixels[screenY * Frame->width + screenX];
+		for(unsigned y = 0; y < PARTICLE_SIZE; y++){
+			for(unsigned x = 0; x < PARTICLE_SIZE; x++){
+				row[x] = Particles->color[i];
+			}
+			row += Frame->width;
+		}
+		markFrameDirty(Frame, screenX, screenY, PARTICLE_SIZE, PARTICLE_SIZE);
+	}
+}
+
+void useKey(UINT16 scanCode, PlayerStruct * Player, GameStruct * Game, CameraStruct * Camera){
+	switch(scanCode){
 		case SCAN_ESC: //Exit the game
 			Game->quit = 1;
 			break;
@@ -480,6 +1242,12 @@ void useKeyboardInput(PlayerStruct * Player, GameStruct * Game, CameraStruct * C
 		case SCAN_F1: //Show mouse cursor
 			Game->showMouseCursor = !Game->showMouseCursor;
 			break;
+		case SCAN_F3: //Rewind the game to the previous snapshot
+			rewindSnapshots(&Game->Snapshots, 1, Game, Player, Camera);
+			break;
+		case SCAN_F4: //Restart the level
+			restartLevel(&Game->Snapshots, Game, Player, Camera);
+			break;
 		case SCAN_F2: //Teleport player to the cursor position relative to the camera
 			if(Game->showMouseCursor){
 				Player->Base.pos.x = Game->mouseX + Camera->pos.x;
@@ -508,6 +1276,19 @@ void useKeyboardInput(PlayerStruct * Player, GameStruct * Game, CameraStruct * C
 	}
 }
 
+void useKeyboardInput(PlayerStruct * Player, GameStruct * Game, CameraStruct * Camera){
+	EFI_INPUT_KEY key;
+	
+	//Read a pressed key from the keyboard driver.
+	gST->ConIn->ReadKeyStroke(gST->ConIn, &key);
+	
+	//Keys pressed while the death effect plays are dropped, so they can't rewind the game before the player respawns.
+	if(Game->deathEffectTime > 0){
+		return;
+	}
+	useKey(key.ScanCode, Player, Game, Camera);
+}
+
 //This function is used only if a mouse driver is loaded to the memory and a mouse is connected.
 void useMouseInput(PlayerStruct * Player, GameStruct * Game, CameraStruct * Camera){
 	EFI_SIMPLE_POINTER_STATE MouseState;
@@ -624,6 +1405,7 @@ void checkCollisions(unsigned blockCount, GameStruct * Game, PlayerStruct * Play
 			if(areObjectsOverlaping(sPos, tileSize, rvec2i(mPos2.x, mPos2.y), tileSize)){
 				Game->Blocks[i].isActive = FALSE;
 				Player->coins++;
+				emitParticles(&Game->Particles, rvec2i(sPos.x + TILE_SIZE / 2, sPos.y + TILE_SIZE / 2), COIN_PARTICLES, 255, 215, 0, 512, 30);
 			}
 			continue;
 		}
@@ -685,6 +1467,92 @@ void checkCollisions(unsigned blockCount, GameStruct * Game, PlayerStruct * Play
 	}
 }
 
+//Returns the first position in Game->EnemyOrder with an enemy that isn't on the left from minX.
+unsigned findFirstEnemyFrom(GameStruct * Game, unsigned enemyCount, int minX){
+	unsigned first = 0, last = enemyCount;
+	while(first < last){
+		unsigned middle = first + (last - first) / 2;
+		if(Game->Enemies[Game->EnemyOrder[middle]].Base.pos.x < minX){
+			first = middle + 1;
+		}
+		else{
+			last = middle;
+		}
+	}
+	return first;
+}
+
+//Enemies move only a few pixels per tick, so their order by x changes very little and the insertion sort runs in almost linear time.
+void sortEnemies(GameStruct * Game, unsigned enemyCount){
+	for(unsigned i = 1; i < enemyCount; i++){
+		unsigned enemyIdx = Game->EnemyOrder[i];
+		int x = Game->Enemies[enemyIdx].Base.pos.x;
+		unsigned j = i;
+		while(j > 0 && Game->Enemies[Game->EnemyOrder[j - 1]].Base.pos.x > x){
+			Game->EnemyOrder[j] = Game->EnemyOrder[j - 1];
+			j--;
+		}
+		Game->EnemyOrder[j] = enemyIdx;
+	}
+}
+
+//Move all enemies and turn them back on the level borders and on contacts with solid blocks.
+//Contacts are found with sort and sweep: enemies and solid blocks are both sorted by x, so each enemy is tested
+//only against the blocks from its own columns.
+void moveEnemies(GameStruct * Game, LevelStruct * Level){
+	for(unsigned i = 0; i < Level->enemyCount; i++){
+		EnemyStruct * Enemy = &Game->Enemies[i];
+		Enemy->Base.pos.x += Enemy->velocity.x;
+		Enemy->Base.pos.y += Enemy->velocity.y;
+		if(Enemy->Base.pos.x < 0 || Enemy->Base.pos.x + TILE_SIZE > Level->width
+			|| Enemy->Base.pos.y < 0 || Enemy->Base.pos.y + TILE_SIZE > Level->height
+		){
+			Enemy->Base.pos.x -= Enemy->velocity.x;
+			Enemy->Base.pos.y -= Enemy->velocity.y;
+			Enemy->velocity = rvec2i(-Enemy->velocity.x, -Enemy->velocity.y);
+		}
+	}
+
+	sortEnemies(Game, Level->enemyCount);
+
+	//All objects have the same width, so blocks on the left from the current enemy are also on the left from the next ones.
+	unsigned firstSolid = 0;
+	for(unsigned i = 0; i < Level->enemyCount; i++){
+		EnemyStruct * Enemy = &Game->Enemies[Game->EnemyOrder[i]];
+		while(firstSolid < Level->solidCount && Game->Blocks[Game->SolidOrder[firstSolid]].pos.x + (int)TILE_SIZE <= Enemy->Base.pos.x){
+			firstSolid++;
+		}
+		for(unsigned j = firstSolid; j < Level->solidCount; j++){
+			ObjectStruct * Block = &Game->Blocks[Game->SolidOrder[j]];
+			if(Block->pos.x >= Enemy->Base.pos.x + (int)TILE_SIZE){
+				break;
+			}
+			//Enemies can touch blocks (e.g. walk on the ground), but they can't enter them.
+			if(Block->pos.y < Enemy->Base.pos.y + (int)TILE_SIZE && Enemy->Base.pos.y < Block->pos.y + (int)TILE_SIZE){
+				Enemy->Base.pos.x -= Enemy->velocity.x;
+				Enemy->Base.pos.y -= Enemy->velocity.y;
+				Enemy->velocity = rvec2i(-Enemy->velocity.x, -Enemy->velocity.y);
+				break;
+			}
+		}
+	}
+}
+
+//If the player collides with an enemy, player dies. Only enemies from the player's columns are checked.
+void checkEnemyCollisions(GameStruct * Game, unsigned enemyCount, PlayerStruct * Player){
+	vec2i tileSize = {TILE_SIZE, TILE_SIZE};
+	for(unsigned i = findFirstEnemyFrom(Game, enemyCount, Player->Base.pos.x - (int)TILE_SIZE); i < enemyCount; i++){
+		EnemyStruct * Enemy = &Game->Enemies[Game->EnemyOrder[i]];
+		if(Enemy->Base.pos.x > Player->Base.pos.x + (int)TILE_SIZE){
+			break;
+		}
+		if(areObjectsOverlaping(rvec2i(Enemy->Base.pos.x + 3, Enemy->Base.pos.y + 3), rvec2i(tileSize.x - 6, tileSize.y - 6), Player->Base.pos, tileSize)){
+			Game->died = 1;
+			break;
+		}
+	}
+}
+
 void movePlayer(PlayerStruct * Player){
 	if(Player->momentum.x == 0 && Player->momentum.y == 0){
 		Player->isMoving = FALSE;
@@ -709,17 +1577,102 @@ void movePlayer(PlayerStruct * Player){
 	}
 }
 
-void animateCoins(GameStruct * Game, unsigned blockCount){
-	if(Game->coinsAnimationTime > 0){
-		Game->coinsAnimationTime--;
-		return;
+BOOLEAN isAnimated(ObjectStruct * Object){
+	return Object->type < sizeof(ANIMATIONS) / sizeof(ANIMATIONS[0]) && ANIMATIONS[Object->type].frameCount > 1;
+}
+void scheduleAnimation(AnimationWheelStruct * Animations, int objectIdx){
+	AnimatedObjectStruct * Animated = &Animations->objects[objectIdx];
+	unsigned slot = Animated->dueTick % ANIMATION_WHEEL_SIZE;
+	Animated->next = Animations->slots[slot];
+	Animations->slots[slot] = objectIdx;
+}
+void addAnimatedObject(AnimationWheelStruct * Animations, ObjectStruct * Object){
+	CONST AnimationStruct * Animation = &ANIMATIONS[Object->type];
+	AnimatedObjectStruct * Animated = &Animations->objects[Animations->objectCount];
+	Animated->Object = Object;
+	Animated->step = 0;
+	Animated->dueTick = Animations->tick + Animation->durations[0];
+	Animated->isChanged = FALSE;
+	Object->frameIdx = Animation->frames[0];
+	scheduleAnimation(Animations, Animations->objectCount);
+	Animations->objectCount++;
+}
+//Put all animated blocks and enemies of the level in the timer wheel.
+EFI_STATUS setupAnimations(AnimationWheelStruct * Animations, GameStruct * Game, LevelStruct * Level){
+	Animations->objectCount = 0;
+	Animations->changedCount = 0;
+	Animations->tick = 0;
+	for(unsigned i = 0; i < ANIMATION_WHEEL_SIZE; i++){
+		Animations->slots[i] = -1;
+	}
+
+	unsigned count = 0;
+	for(unsigned i = 0; i < Level->blockCount; i++){
+		count += isAnimated(&Game->Blocks[i]);
+	}
+	for(unsigned i = 0; i < Level->enemyCount; i++){
+		count += isAnimated(&Game->Enemies[i].Base);
+	}
+	Animations->objects = AllocatePool(sizeof(AnimatedObjectStruct) * (count + 1));
+	Animations->changed = AllocatePool(sizeof(unsigned) * (count + 1));
+	if(Animations->objects == NULL || Animations->changed == NULL){
+		return EFI_OUT_OF_RESOURCES;
 	}
-	Game->coinsAnimationTime = MONEY_ANIMATION_DURATION;
 
-	for(unsigned blockIdx = 0; blockIdx < blockCount; blockIdx++){
-		if(Game->Blocks[blockIdx].type == coin){
-			Game->Blocks[blockIdx].frameIdx = (Game->Blocks[blockIdx].frameIdx + 1) % 8; 
+	for(unsigned i = 0; i < Level->blockCount; i++){
+		if(isAnimated(&Game->Blocks[i])){
+			addAnimatedObject(Animations, &Game->Blocks[i]);
+		}
+	}
+	for(unsigned i = 0; i < Level->enemyCount; i++){
+		if(isAnimated(&Game->Enemies[i].Base)){
+			addAnimatedObject(Animations, &Game->Enemies[i].Base);
+		}
+	}
+	return EFI_SUCCESS;
+}
+//Advance animations of the objects whose next frame is due on this tick.
+void updateAnimations(AnimationWheelStruct * Animations, RenderGovernorStruct * Governor){
+	//Frozen animations let the renderer skip redrawing the terrain on frames without movement.
+	if(Governor->quality >= render_no_animation){
+		return;
+	}
+	Animations->tick++;
+
+	//Take the whole list out of the slot. Objects due in a later round of the wheel go back to the same slot.
+	unsigned slot = Animations->tick % ANIMATION_WHEEL_SIZE;
+	int objectIdx = Animations->slots[slot];
+	Animations->slots[slot] = -1;
+	while(objectIdx >= 0){
+		AnimatedObjectStruct * Animated = &Animations->objects[objectIdx];
+		int nextIdx = Animated->next;
+		if(Animated->dueTick == Animations->tick){
+			CONST AnimationStruct * Animation = &ANIMATIONS[Animated->Object->type];
+			Animated->step = (Animated->step + 1) % Animation->frameCount;
+			Animated->Object->frameIdx = Animation->frames[Animated->step];
+			Animated->dueTick = Animations->tick + Animation->durations[Animated->step];
+			//Inactive objects (e.g. collected coins) keep their phase, because rewinding can bring them back, but they are never redrawn.
+			if(!Animated->isChanged && Animated->Object->isActive){
+				Animated->isChanged = TRUE;
+				Animations->changed[Animations->changedCount++] = objectIdx;
+			}
 		}
+		scheduleAnimation(Animations, objectIdx);
+		objectIdx = nextIdx;
+	}
+}
+
+SpriteArray * getObjectSprites(GameStruct * Game, enum ObjectType type){
+	switch(type){
+		case coin:
+			return Game->CoinSprites;
+		case player:
+			return Game->PlayerSprites;
+		case patrolling_spider:
+		case climbing_spider:
+			return Game->SpiderSprites;
+		default:
+			return Game->BlocksSprites;
 	}
 }
 
@@ -740,69 +1693,161 @@ void moveCamera(CameraStruct * Camera, ObjectStruct * Player, unsigned levelWidt
 	}
 }
 
-void drawEverything(GameStruct * Game, PlayerStruct * Player, vec2i castlePos, CameraStruct * Camera, unsigned blockCount){
-	if(Player->isMoving || Game->isMouseMoving){
-		clearScreenWithColor(Game->Screen, 119, 181, 254);
+void drawEverything(GameStruct * Game, PlayerStruct * Player, vec2i castlePos, CameraStruct * Camera, unsigned blockCount, unsigned enemyCount){
+	//Find enemies in the columns visible by the camera.
+	unsigned firstEnemy = findFirstEnemyFrom(Game, enemyCount, Camera->pos.x - (int)TILE_SIZE + 1);
+	unsigned lastEnemy = findFirstEnemyFrom(Game, enemyCount, Camera->pos.x + (int)SCREEN_WIDTH);
+
+	BOOLEAN clearFrame = Game->frameNeedsClear || Game->isMouseMoving;
+	//Enemies move every tick, so the frame must be cleared if any of them is visible.
+	for(unsigned i = firstEnemy; !clearFrame && i < lastEnemy; i++){
+		int enemyY = Game->Enemies[Game->EnemyOrder[i]].Base.pos.y;
+		if(enemyY + (int)TILE_SIZE > Camera->pos.y && enemyY < Camera->pos.y + (int)SCREEN_HEIGHT){
+			clearFrame = TRUE;
+		}
+	}
+	if(clearFrame){
+		clearFrameWithColor(&Game->Frame, 119, 181, 254);
 	}
+	Game->frameNeedsClear = FALSE;
 	Game->isMouseMoving = FALSE;
+
+	//If nothing moved, the terrain drawn in the last frame is still valid except for the animated objects that changed.
+	BOOLEAN drawTerrain = clearFrame;
 	
 	//Draw blocks and coins 
-	for(unsigned i = 0; i < blockCount; i++){
-		if(Game->Blocks[i].type == coin){
-			drawGameObject(&Game->Blocks[i], Game->Screen, Game->CoinSprites, Camera);
+	if(drawTerrain){
+		for(unsigned i = 0; i < blockCount; i++){
+			drawGameObject(&Game->Blocks[i], &Game->Frame, getObjectSprites(Game, Game->Blocks[i].type), Camera);
 		}
-		else{
-			drawGameObject(&Game->Blocks[i], Game->Screen, Game->BlocksSprites, Camera);
+	}
+	//Sprites are opaque, so changed objects are simply drawn over their previous frame.
+	//They can cover the score or the castle, which are then redrawn too.
+	BOOLEAN redrawOverlays = FALSE;
+	for(unsigned i = 0; i < Game->Animations.changedCount; i++){
+		AnimatedObjectStruct * Animated = &Game->Animations.objects[Game->Animations.changed[i]];
+		if(!drawTerrain && drawGameObject(Animated->Object, &Game->Frame, getObjectSprites(Game, Animated->Object->type), Camera)){
+			redrawOverlays = TRUE;
 		}
+		Animated->isChanged = FALSE;
 	}
+	Game->Animations.changedCount = 0;
 
-	//Draw player
-	drawGameObject(&Player->Base, Game->Screen, Game->PlayerSprites, Camera);
+	//Draw enemies
+	for(unsigned i = firstEnemy; i < lastEnemy; i++){
+		ObjectStruct * Enemy = &Game->Enemies[Game->EnemyOrder[i]].Base;
+		drawGameObject(Enemy, &Game->Frame, getObjectSprites(Game, Enemy->type), Camera);
+	}
+
+	//Draw player (a dead player is replaced by the death effect)
+	if(!Game->died){
+		drawGameObject(&Player->Base, &Game->Frame, Game->PlayerSprites, Camera);
+	}
+
+	//Draw particles
+	drawParticles(&Game->Particles, &Game->Frame, Camera);
 	
-	//Divide player coins count into digits and draw them with the bitmap "font" (this "font" has only digits).
-	unsigned digit0 = Player->coins;
-	if(Player->coins > 9){
-		digit0 -= (int)(Player->coins / 10) * 10;
-	}
-	unsigned digit1 = (int)(Player->coins / 10);
-	if(Player->coins > 99){
-		digit1 -= (int)(Player->coins / 100) * 100;
-	}
-	drawBitmap(Game->Screen, Game->Font->sprites[digit0], 46, 10, 36, 36);
-	drawBitmap(Game->Screen, Game->Font->sprites[digit1], 10, 10, 36, 36);
-
-	//Draw castle (the end goal of the game).
-	for(int i = 0; i < 16; i++){
-		//Don't draw the parts of the castle that are not visible by the player.
-		if(castlePos.x + (i % 4) * 40 > Camera->pos.x + SCREEN_WIDTH - 40
-			|| castlePos.y + (i / 4) * 40 > Camera->pos.y + SCREEN_HEIGHT - 40
-			|| castlePos.x + (i % 4) * 40 < Camera->pos.x
-			|| castlePos.y + (i / 4) * 40 < Camera->pos.y
-		){
-			continue;
+	//Redraw the score only when it's needed, if the renderer is overloaded.
+	if(clearFrame || redrawOverlays || Game->Governor.quality < render_no_hud_refresh || Game->hudCoins != Player->coins){
+		//Divide player coins count into digits and draw them with the bitmap "font" (this "font" has only digits).
+		unsigned digit0 = Player->coins;
+		if(Player->coins > 9){
+			digit0 -= (int)(Player->coins / 10) * 10;
 		}
-		drawBitmap(Game->Screen, Game->CastleSprites->sprites[i],
+		unsigned digit1 = (int)(Player->coins / 10);
+		if(Player->coins > 99){
+			digit1 -= (int)(Player->coins / 100) * 100;
+		}
+		drawBitmap(&Game->Frame, Game->Font, digit0, 46, 10);
+		drawBitmap(&Game->Frame, Game->Font, digit1, 10, 10);
+		Game->hudCoins = Player->coins;
+	}
+
+	//Draw castle (the end goal of the game). Parts that are not visible by the player are clipped.
+	for(int i = 0; (drawTerrain || redrawOverlays) && i < 16; i++){
+		drawBitmap(&Game->Frame, Game->CastleSprites, i,
 			castlePos.x + (i % 4) * 40 - Camera->pos.x,
-			castlePos.y + (i / 4) * 40 - Camera->pos.y,
-			40, 40
+			castlePos.y + (i / 4) * 40 - Camera->pos.y
 		);
 	}
 
 	//Draw the mouse cursor.
 	if(Game->showMouseCursor){
-		drawBitmap(Game->Screen, Game->CursorSprite->sprites[0], Game->mouseX, Game->mouseY, 40, 40);
+		drawBitmap(&Game->Frame, Game->CursorSprite, 0, Game->mouseX, Game->mouseY);
 	}
 }
 
-void checkGameState(GameStruct * Game, PlayerStruct * Player, LevelStruct * Level){
+//Respawn the player a few seconds before the death. If there are no snapshots yet, start the level again.
+void respawnPlayer(GameStruct * Game, PlayerStruct * Player, CameraStruct * Camera){
+	if(!rewindSnapshots(&Game->Snapshots, RESPAWN_SNAPSHOTS, Game, Player, Camera)){
+		restartLevel(&Game->Snapshots, Game, Player, Camera);
+	}
+}
+//Burst the player into particles and let them fly for a while before the player respawns.
+//The effect runs in the game loop like any other tick, so the render governor handles its frames too.
+void startDeathEffect(GameStruct * Game, PlayerStruct * Player){
+	emitParticles(&Game->Particles, rvec2i(Player->Base.pos.x + TILE_SIZE / 2, Player->Base.pos.y + TILE_SIZE / 2), DEATH_PARTICLES, 200, 20, 20, 1024, DEATH_EFFECT_DURATION);
+	Game->deathEffectTime = DEATH_EFFECT_DURATION;
+}
+void updateDeathEffect(GameStruct * Game, PlayerStruct * Player, CameraStruct * Camera){
+	updateParticles(&Game->Particles);
+	Game->frameNeedsClear = TRUE;
+	Game->deathEffectTime--;
+	if(Game->deathEffectTime == 0){
+		respawnPlayer(Game, Player, Camera);
+	}
+}
+
+//Update the game state for a single timer tick.
+void updateGame(GameStruct * Game, PlayerStruct * Player, LevelStruct * Level, CameraStruct * Camera){
+	if(Game->deathEffectTime > 0){
+		updateDeathEffect(Game, Player, Camera);
+		return;
+	}
+
+	useGravity(Player);
+
+	checkCollisions(Level->blockCount, Game, Player);
+
+	movePlayer(Player);
+	if(Player->isMoving){
+		Game->frameNeedsClear = TRUE;
+	}
+
+	moveEnemies(Game, Level);
+
+	checkEnemyCollisions(Game, Level->enemyCount, Player);
+
+	updateAnimations(&Game->Animations, &Game->Governor);
+
+	//Particles drawn in the last frame must be erased, also on the tick when the last of them dies.
+	unsigned particleCount = Game->Particles.count;
+	updateParticles(&Game->Particles);
+	if(particleCount > 0 || Game->Particles.count > 0){
+		Game->frameNeedsClear = TRUE;
+	}
+
+	moveCamera(Camera, &Player->Base, Level->width, Level->height);
+
+	if(!Game->died){
+		takeSnapshot(&Game->Snapshots, Game, Player, Camera);
+	}
+}
+
+void checkGameState(GameStruct * Game, PlayerStruct * Player, LevelStruct * Level, CameraStruct * Camera){
 	UINTN eventId;
 	
 	//DEATH
-	if(Game->died || Player->Base.pos.y > Level->height){
-		clearScreenWithColor(Game->Screen, 0, 0, 0);
-		Print(L"You died. F.\n");
-		Game->quit = 1;
-		gBS->WaitForEvent(1, &gST->ConIn->WaitForKey, &eventId);
+	if(Game->deathEffectTime > 0){
+		return;
+	}
+	if(Game->died){
+		startDeathEffect(Game, Player);
+		return;
+	}
+	if(Player->Base.pos.y > Level->height){
+		respawnPlayer(Game, Player, Camera);
+		return;
 	}
 
 	//WIN
@@ -814,6 +1859,221 @@ void checkGameState(GameStruct * Game, PlayerStruct * Player, LevelStruct * Leve
 	}
 }
 
+//Hash all pixels of the frame with 64-bit FNV-1a (one pixel at a time instead of one byte).
+UINT64 hashFrame(FrameStruct * Frame){
+	UINT32 * pixels = (UINT32*) Frame->pixels;
+	UINT64 hash = 14695981039346656037ULL;
+	for(UINTN i = 0; i < Frame->width * Frame->height; i++){
+		hash = (hash ^ pixels[i]) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+//Replace the file on the boot volume with a new one.
+EFI_STATUS writeFile(EFI_FILE_PROTOCOL * RootDirectory, CHAR16 * fileName, VOID * buffer, UINTN bufferSize){
+	EFI_FILE_PROTOCOL * File;
+	//Delete the old file, so no data from it is left after the end of the new one.
+	if(!EFI_ERROR(RootDirectory->Open(RootDirectory, &File, fileName, EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE, 0))){
+		File->Delete(File);
+	}
+	EFI_STATUS status = RootDirectory->Open(RootDirectory, &File, fileName, EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE, 0);
+	if(EFI_ERROR(status)){
+		return status;
+	}
+	status = File->Write(File, &bufferSize, buffer);
+	File->Close(File);
+	return status;
+}
+
+//Save the frame as a 24-bit .bmp image (the same format as game sprites).
+EFI_STATUS saveFrameAsBitmap(EFI_FILE_PROTOCOL * RootDirectory, FrameStruct * Frame, CHAR16 * fileName){
+	UINTN rowSize = (Frame->width * 3 + 3) & ~3u;
+	UINTN bufferSize = BMP_HEADER_SIZE + rowSize * Frame->height;
+	CHAR8 * bitmapBuffer = AllocateZeroPool(bufferSize);
+	if(bitmapBuffer == NULL){
+		return EFI_OUT_OF_RESOURCES;
+	}
+
+	bitmapBuffer[0] = 'B';
+	bitmapBuffer[1] = 'M';
+	*(UINT32*)&bitmapBuffer[2] = (UINT32)bufferSize;			//File size
+	*(UINT32*)&bitmapBuffer[10] = BMP_HEADER_SIZE;				//Offset of the pixel data
+	*(UINT32*)&bitmapBuffer[14] = 40;							//Size of the info header
+	*(UINT32*)&bitmapBuffer[18] = Frame->width;
+	*(UINT32*)&bitmapBuffer[22] = Frame->height;
+	*(UINT16*)&bitmapBuffer[26] = 1;							//Color planes
+	*(UINT16*)&bitmapBuffer[28] = 24;							//Bits per pixel
+	*(UINT32*)&bitmapBuffer[34] = (UINT32)(rowSize * Frame->height);
+
+	//Rows in .bmp files are stored from the bottom to the top.
+	for(unsigned y = 0; y < Frame->height; y++){
+		CHAR8 * row = &bitmapBuffer[BMP_HEADER_SIZE + (Frame->height - 1 - y) * rowSize];
+		for(unsigned x = 0; x < Frame->width; x++){
+			EFI_GRAPHICS_OUTPUT_BLT_PIXEL * Pixel = &Frame->pixels[y * Frame->width + x];
+			row[3 * x + 0] = Pixel->Blue;
+			row[3 * x + 1] = Pixel->Green;
+			row[3 * x + 2] = Pixel->Red;
+		}
+	}
+
+	EFI_STATUS status = writeFile(RootDirectory, fileName, bitmapBuffer, bufferSize);
+	FreePool(bitmapBuffer);
+	return status;
+}
+
+enum GoldenMode{
+	golden_off, golden_record, golden_check
+};
+//Fixed input used by golden runs. Each key is applied on every tick of its duration.
+typedef struct{
+	UINT16 scanCode;
+	unsigned ticks;
+} ScriptedInputStruct;
+CONST ScriptedInputStruct GOLDEN_INPUT[] = {
+	{SCAN_NULL, 10}, {SCAN_RIGHT, 20}, {SCAN_UP, 1}, {SCAN_NULL, 60}, {SCAN_LEFT, 15},
+	{SCAN_F1, 1}, {SCAN_RIGHT, 10}, {SCAN_UP, 1}, {SCAN_LEFT, 30}, {SCAN_NULL, 40}
+};
+#define GOLDEN_FILE_NAME L"golden.bin"
+
+//Play the level with the fixed input and hash every presented frame. Golden runs don't wait for the timer and don't skip frames,
+//so the same build always presents the same frames. Hashes are saved to (or compared with) the golden file.
+//Frames are read back from the screen and hashed there, because only the changed parts of a frame are presented.
+void runGoldenFrames(GameStruct * Game, PlayerStruct * Player, LevelStruct * Level, CameraStruct * Camera, enum GoldenMode mode){
+	unsigned frameCount = 0;
+	for(unsigned i = 0; i < sizeof(GOLDEN_INPUT) / sizeof(GOLDEN_INPUT[0]); i++){
+		frameCount += GOLDEN_INPUT[i].ticks;
+	}
+	UINT64 * hashes = AllocatePool(frameCount * sizeof(UINT64));
+	FrameStruct Screen = Game->Frame;
+	Screen.pixels = AllocatePool(Screen.width * Screen.height * sizeof(EFI_GRAPHICS_OUTPUT_BLT_PIXEL));
+	if(hashes == NULL || Screen.pixels == NULL){
+		Print(L"Error: Not enough memory for the golden run.\n");
+		if(hashes != NULL){
+			FreePool(hashes);
+		}
+		if(Screen.pixels != NULL){
+			FreePool(Screen.pixels);
+		}
+		return;
+	}
+
+	//Load hashes of frames presented by the reference build.
+	UINT64 * goldenHashes = NULL;
+	unsigned goldenFrameCount = 0;
+	if(mode == golden_check){
+		EFI_FILE_PROTOCOL * GoldenFile;
+		if(EFI_ERROR(Game->RootDirectory->Open(Game->RootDirectory, &GoldenFile, GOLDEN_FILE_NAME, EFI_FILE_MODE_READ, 0))){
+			Print(L"Error: Could not open file \"%s\". Record it first with -record.\n", GOLDEN_FILE_NAME);
+			FreePool(hashes);
+			FreePool(Screen.pixels);
+			return;
+		}
+		UINTN bufferSize = sizeof(unsigned);
+		GoldenFile->Read(GoldenFile, &bufferSize, (VOID*) &goldenFrameCount);
+		if(bufferSize != sizeof(unsigned)){
+			goldenFrameCount = 0;
+		}
+		if(goldenFrameCount > frameCount){
+			goldenFrameCount = frameCount;
+		}
+		goldenHashes = AllocatePool(frameCount * sizeof(UINT64));
+		bufferSize = goldenFrameCount * sizeof(UINT64);
+		GoldenFile->Read(GoldenFile, &bufferSize, (VOID*) goldenHashes);
+		GoldenFile->Close(GoldenFile);
+		//Don't trust the frame count of a truncated file.
+		if(goldenFrameCount > bufferSize / sizeof(UINT64)){
+			goldenFrameCount = (unsigned)(bufferSize / sizeof(UINT64));
+		}
+	}
+
+	CHAR16 fileName[32];
+	unsigned frameIdx = 0, mismatches = 0, presentErrors = 0;
+	for(unsigned inputIdx = 0; inputIdx < sizeof(GOLDEN_INPUT) / sizeof(GOLDEN_INPUT[0]); inputIdx++){
+		for(unsigned tick = 0; tick < GOLDEN_INPUT[inputIdx].ticks && !Game->died; tick++){
+			useKey(GOLDEN_INPUT[inputIdx].scanCode, Player, Game, Camera);
+			updateGame(Game, Player, Level, Camera);
+			drawEverything(Game, Player, Level->castlePos, Camera, Level->blockCount, Level->enemyCount);
+			presentFrame(Game->Screen, &Game->Frame);
+			Game->Screen->Blt(
+				Game->Screen, Screen.pixels, EfiBltVideoToBltBuffer,
+				0, 0, 0, 0, Screen.width, Screen.height,
+				Screen.width * sizeof(EFI_GRAPHICS_OUTPUT_BLT_PIXEL)
+			);
+			hashes[frameIdx] = hashFrame(&Screen);
+			//The screen must show the whole frame drawn in memory, otherwise some drawn part wasn't presented.
+			if(hashes[frameIdx] != hashFrame(&Game->Frame)){
+				presentErrors++;
+			}
+
+			if(mode == golden_record && frameIdx % GOLDEN_DUMP_INTERVAL == 0){
+				UnicodeSPrint(fileName, sizeof(fileName), L"frame%04d.bmp", frameIdx);
+				saveFrameAsBitmap(Game->RootDirectory, &Screen, fileName);
+			}
+			if(mode == golden_check && (frameIdx >= goldenFrameCount || hashes[frameIdx] != goldenHashes[frameIdx])){
+				//Save the first different frame, so it can be compared with the frame saved by the reference build.
+				if(mismatches == 0){
+					UnicodeSPrint(fileName, sizeof(fileName), L"mismatch%04d.bmp", frameIdx);
+					saveFrameAsBitmap(Game->RootDirectory, &Screen, fileName);
+				}
+				mismatches++;
+			}
+			frameIdx++;
+		}
+	}
+
+	clearScreenWithColor(Game->Screen, 0, 0, 0);
+	if(Game->died){
+		Print(L"The player died during the golden run at frame %d.\n", frameIdx - 1);
+	}
+	if(presentErrors > 0){
+		Print(L"%d presented frames are different from the frames drawn in memory.\n", presentErrors);
+	}
+	if(mode == golden_record){
+		//Golden file layout: number of frames followed by the hash of each frame.
+		UINTN bufferSize = sizeof(unsigned) + frameIdx * sizeof(UINT64);
+		CHAR8 * goldenBuffer = AllocatePool(bufferSize);
+		*(unsigned*)goldenBuffer = frameIdx;
+		CopyMem(&goldenBuffer[sizeof(unsigned)], hashes, frameIdx * sizeof(UINT64));
+		if(EFI_ERROR(writeFile(Game->RootDirectory, GOLDEN_FILE_NAME, goldenBuffer, bufferSize))){
+			Print(L"Error: Could not write file \"%s\".\n", GOLDEN_FILE_NAME);
+		}
+		else{
+			Print(L"Recorded %d frame hashes. Last hash: %016lx.\n", frameIdx, hashes[frameIdx - 1]);
+		}
+		FreePool(goldenBuffer);
+	}
+	else{
+		if(frameIdx != goldenFrameCount){
+			Print(L"Golden run has %d frames, but this run has %d frames.\n", goldenFrameCount, frameIdx);
+		}
+		if(mismatches == 0 && presentErrors == 0 && frameIdx == goldenFrameCount){
+			Print(L"All %d frames are identical to the golden run.\n", frameIdx);
+		}
+		else{
+			Print(L"%d of %d frames are different from the golden run.\n", mismatches, frameIdx);
+		}
+		FreePool(goldenHashes);
+	}
+	FreePool(hashes);
+	FreePool(Screen.pixels);
+}
+
+//Read the golden mode from the command line: "-record" saves a new golden run, "-check" compares with it.
+enum GoldenMode readGoldenMode(EFI_HANDLE ImageHandle){
+	EFI_SHELL_PARAMETERS_PROTOCOL * ShellParameters;
+	EFI_STATUS status = gBS->HandleProtocol(ImageHandle, &gEfiShellParametersProtocolGuid, (VOID**) &ShellParameters);
+	if(EFI_ERROR(status) || ShellParameters->Argc < 2){
+		return golden_off;
+	}
+	if(StrCmp(ShellParameters->Argv[1], L"-record") == 0){
+		return golden_record;
+	}
+	if(StrCmp(ShellParameters->Argv[1], L"-check") == 0){
+		return golden_check;
+	}
+	return golden_off;
+}
+
 EFI_STATUS EFIAPI UefiMain (IN EFI_HANDLE ImageHandle, IN EFI_SYSTEM_TABLE * SystemTable){
 	GameStruct Game;
 	if(setupGame(&Game) == EFI_ABORTED){
@@ -826,13 +2086,31 @@ EFI_STATUS EFIAPI UefiMain (IN EFI_HANDLE ImageHandle, IN EFI_SYSTEM_TABLE * Sys
 		return EFI_ABORTED;
 	}
 	
+	if(EFI_ERROR(setupAnimations(&Game.Animations, &Game, &Level))){
+		Print(L"Error: Not enough memory for animations.\n");
+		return EFI_ABORTED;
+	}
+
 	CameraStruct Camera = {rvec2i(0, 0)};
+	moveCamera(&Camera, &Player.Base, Level.width, Level.height);
+
+	if(EFI_ERROR(setupSnapshots(&Game.Snapshots, &Game, &Player, &Camera, Level.blockCount, Level.enemyCount))){
+		Print(L"Error: Could not set up game snapshots (not enough memory or too many objects).\n");
+		return EFI_ABORTED;
+	}
 
 	UINTN eventId;
 
 	clearScreenWithColor(Game.Screen, 119, 181, 254);
 
+	enum GoldenMode goldenMode = readGoldenMode(ImageHandle);
+	if(goldenMode != golden_off){
+		runGoldenFrames(&Game, &Player, &Level, &Camera, goldenMode);
+		Game.quit = 1;
+	}
+
 	//GAME LOOP
+	Game.Governor.lastTickTime = AsmReadTsc();
 	while(!Game.quit){
 		gBS->WaitForEvent(3, Game.events, &eventId);
 		
@@ -843,19 +2121,20 @@ EFI_STATUS EFIAPI UefiMain (IN EFI_HANDLE ImageHandle, IN EFI_SYSTEM_TABLE * Sys
 			useMouseInput(&Player, &Game, &Camera);
 		}
 		else if(eventId == 2){ //Check if timer is triggered.
-			useGravity(&Player);
-
-			checkCollisions(Level.blockCount, &Game, &Player);
-
-    		movePlayer(&Player);
-
-			animateCoins(&Game, Level.blockCount);
-
-			moveCamera(&Camera, &Player.Base, Level.width, Level.height);
-
-			drawEverything(&Game, &Player, Level.castlePos, &Camera, Level.blockCount);
+			//Simulate every tick that passed since the last frame, including ticks whose timer events were lost while it was presented.
+			unsigned dueTicks = countDueTicks(&Game.Governor);
+			for(unsigned tick = 0; tick < dueTicks && !Game.quit; tick++){
+				updateGame(&Game, &Player, &Level, &Camera);
+				checkGameState(&Game, &Player, &Level, &Camera);
+			}
 
-			checkGameState(&Game, &Player, &Level);
+			if(!Game.quit){
+				UINT64 drawStartTime = AsmReadTsc();
+				drawEverything(&Game, &Player, Level.castlePos, &Camera, Level.blockCount, Level.enemyCount);
+				UINT64 presentStartTime = AsmReadTsc();
+				presentFrame(Game.Screen, &Game.Frame);
+				updateRenderGovernor(&Game.Governor, presentStartTime - drawStartTime, AsmReadTsc() - presentStartTime);
+			}
 		}
 	}
 
@@ -3,28 +3,175 @@
 #Modified version of https://github.com/rubikshift/UEFI_MARIO/blob/master/levelmaker.py
 
 import argparse
+import struct
+
+#The binary level is already in the layout used by the game, so the game only checks the header and reads sections straight into place.
+#Everything below must match LevelHeaderStruct, ObjectStruct, EnemyStruct and enum ObjectType in Platformer.c.
+#Change LEVEL_VERSION whenever the layout changes.
+LEVEL_MAGIC = 0x564C5055 #"UPLV"
+LEVEL_VERSION = 1
+LEVEL_ALIGNMENT = 8
+TILE_SIZE = 40
+ENEMY_SPEED = 2
+
+HEADER_FORMAT = "<14I4i4I"
+OBJECT_FORMAT = "<2i2i2B2x" #pos, type, frameIdx, isActive, isSolid
+ENEMY_FORMAT = OBJECT_FORMAT + "2i" #Base, velocity
+
+#Object types from enum ObjectType.
+GREEN_BRICK, RED_BRICK, MOSSY_BRICK, WEB, SPIDER, COIN, PLAYER, PATROLLING_SPIDER, CLIMBING_SPIDER = range(1, 10)
+
+#Letter: (type, frameIdx, isSolid)
+BLOCKS = {
+    "G": (GREEN_BRICK, 0, True),
+    "R": (RED_BRICK, 1, True),
+    "M": (MOSSY_BRICK, 2, True),
+    "W": (WEB, 3, True),
+    "S": (SPIDER, 4, True),
+    "C": (COIN, 0, False),
+}
+#Letter: (type, frameIdx, velocity)
+ENEMIES = {
+    "X": (PATROLLING_SPIDER, 0, (ENEMY_SPEED, 0)),
+    "Y": (CLIMBING_SPIDER, 1, (0, ENEMY_SPEED)),
+}
+
+def align(offset):
+    return (offset + LEVEL_ALIGNMENT - 1) // LEVEL_ALIGNMENT * LEVEL_ALIGNMENT
 
 def converter(level, binary):
-    with open(level, "r") as inputFile, open(binary, "wb") as outputFile:
-        data = inputFile.read().splitlines()
-        
-        outputFile.write(len(data).to_bytes(4, "little"))
-        outputFile.write(len(data[0]).to_bytes(4, "little"))
-        
-        tiles = 0
-        
-        for d in data:
-            tiles += d.upper().count("G") + d.upper().count("R") + d.upper().count("M") + d.upper().count("W") + d.upper().count("S") + d.upper().count("C")
+    with open(level, "r") as inputFile:
+        data = [d.upper() for d in inputFile.read().splitlines() if d]
+
+    height = len(data)
+    width = len(data[0])
+    spawn = (0, 0)
+    castle = (600, 600)
+
+    #Blocks are stored row by row, like the game read them from the map before.
+    blocks = []
+    for y, d in enumerate(data):
+        for x, tile in enumerate(d):
+            if tile in BLOCKS:
+                blocks.append((x, y) + BLOCKS[tile])
+            elif tile == "P":
+                spawn = (x * TILE_SIZE, y * TILE_SIZE)
+            elif tile == "E":
+                castle = (x * TILE_SIZE, y * TILE_SIZE)
+
+    #Solid blocks sorted by their column for the broadphase. The sort is stable, so it gives the same order as a counting sort.
+    solidOrder = sorted((i for i, block in enumerate(blocks) if block[4]), key=lambda i: blocks[i][0])
+
+    #Enemies are stored column by column, so they are already sorted by their x position.
+    enemies = []
+    for x in range(width):
+        for y in range(height):
+            tile = data[y][x] if x < len(data[y]) else "."
+            if tile in ENEMIES:
+                enemies.append((x, y) + ENEMIES[tile])
+
+    blocksOffset = align(struct.calcsize(HEADER_FORMAT))
+    solidOrderOffset = align(blocksOffset + len(blocks) * struct.calcsize(OBJECT_FORMAT))
+    enemiesOffset = align(solidOrderOffset + len(solidOrder) * 4)
+    fileSize = align(enemiesOffset + len(enemies) * struct.calcsize(ENEMY_FORMAT))
+
+    output = bytearray(fileSize)
+    struct.pack_into(HEADER_FORMAT, output, 0,
+        LEVEL_MAGIC, LEVEL_VERSION, struct.calcsize(HEADER_FORMAT), struct.calcsize(OBJECT_FORMAT), struct.calcsize(ENEMY_FORMAT), TILE_SIZE,
+        width, height, len(blocks), len(solidOrder), len(enemies),
+        blocksOffset, solidOrderOffset, enemiesOffset,
+        spawn[0], spawn[1], castle[0], castle[1],
+        fileSize, 0, 0, 0
+    )
+    for i, (x, y, objectType, frameIdx, isSolid) in enumerate(blocks):
+        struct.pack_into(OBJECT_FORMAT, output, blocksOffset + i * struct.calcsize(OBJECT_FORMAT),
+            x * TILE_SIZE, y * TILE_SIZE, objectType, frameIdx, True, isSolid)
+    struct.pack_into("<%dI" % len(solidOrder), output, solidOrderOffset, *solidOrder)
+    for i, (x, y, objectType, frameIdx, velocity) in enumerate(enemies):
+        struct.pack_into(ENEMY_FORMAT, output, enemiesOffset + i * struct.calcsize(ENEMY_FORMAT),
+            x * TILE_SIZE, y * TILE_SIZE, objectType, frameIdx, True, False, velocity[0], velocity[1])
+
+    with open(binary, "wb") as outputFile:
+        outputFile.write(output)
+
+#Check a binary level offline with the same rules as the game and the invariants the game relies on without checking them.
+def validator(binary):
+    with open(binary, "rb") as inputFile:
+        data = inputFile.read()
+
+    if len(data) < struct.calcsize(HEADER_FORMAT):
+        return "file is shorter than the header"
+    (magic, version, headerSize, objectSize, enemySize, tileSize,
+        width, height, blockCount, solidCount, enemyCount,
+        blocksOffset, solidOrderOffset, enemiesOffset,
+        spawnX, spawnY, castleX, castleY,
+        fileSize, _, _, _) = struct.unpack_from(HEADER_FORMAT, data)
+
+    if magic != LEVEL_MAGIC:
+        return "not a level file (rebuild it from the text file)"
+    if version != LEVEL_VERSION:
+        return "unsupported version %d" % version
+    if headerSize != struct.calcsize(HEADER_FORMAT) or objectSize != struct.calcsize(OBJECT_FORMAT) or enemySize != struct.calcsize(ENEMY_FORMAT):
+        return "structure sizes don't match the game"
+    if tileSize != TILE_SIZE:
+        return "tile size %d doesn't match the game" % tileSize
+    if fileSize != len(data):
+        return "file size %d doesn't match the header (%d)" % (len(data), fileSize)
+    if solidCount > blockCount:
+        return "more solid blocks than blocks"
+
+    sections = [
+        ("blocks", blocksOffset, blockCount * objectSize),
+        ("solid order", solidOrderOffset, solidCount * 4),
+        ("enemies", enemiesOffset, enemyCount * enemySize),
+    ]
+    end = headerSize
+    for name, offset, size in sections:
+        if offset % LEVEL_ALIGNMENT != 0:
+            return "%s section is not aligned" % name
+        if offset < end or offset + size > fileSize:
+            return "%s section overlaps another section or the end of the file" % name
+        end = offset + size
+
+    levelWidth, levelHeight = width * TILE_SIZE, height * TILE_SIZE
+    def onMap(x, y):
+        return 0 <= x < levelWidth and 0 <= y < levelHeight and x % TILE_SIZE == 0 and y % TILE_SIZE == 0
+
+    blocks = [struct.unpack_from(OBJECT_FORMAT, data, blocksOffset + i * objectSize) for i in range(blockCount)]
+    for i, (x, y, objectType, frameIdx, isActive, isSolid) in enumerate(blocks):
+        if not onMap(x, y) or objectType not in (GREEN_BRICK, RED_BRICK, MOSSY_BRICK, WEB, SPIDER, COIN) or not isActive:
+            return "block %d is invalid" % i
+
+    solidOrder = struct.unpack_from("<%dI" % solidCount, data, solidOrderOffset)
+    if sorted(solidOrder) != [i for i, block in enumerate(blocks) if block[5]]:
+        return "solid order doesn't list every solid block once"
+    if any(blocks[a][0] > blocks[b][0] for a, b in zip(solidOrder, solidOrder[1:])):
+        return "solid order is not sorted by x position"
 
-        outputFile.write(tiles.to_bytes(4, "little"))
+    enemies = [struct.unpack_from(ENEMY_FORMAT, data, enemiesOffset + i * enemySize) for i in range(enemyCount)]
+    for i, (x, y, objectType, frameIdx, isActive, isSolid, velocityX, velocityY) in enumerate(enemies):
+        if not onMap(x, y) or objectType not in (PATROLLING_SPIDER, CLIMBING_SPIDER) or not isActive:
+            return "enemy %d is invalid" % i
+    if any(a[0] > b[0] for a, b in zip(enemies, enemies[1:])):
+        return "enemies are not sorted by x position"
 
-        for d in data:
-            outputFile.write(bytes(d.upper(), "ascii"))
+    if not onMap(spawnX, spawnY):
+        return "player spawn point is outside the map"
+    return None
 
 
 if __name__ == "__main__":
     parser = argparse.ArgumentParser()
-    parser.add_argument("input", type=str, help="Input: Text file with the map")
-    parser.add_argument("output", type=str, help="Binary file with the map")
+    parser.add_argument("input", type=str, help="Input: Text file with the map (or a binary file with --check)")
+    parser.add_argument("output", type=str, nargs="?", help="Binary file with the map")
+    parser.add_argument("--check", action="store_true", help="Only validate the binary file given as the input")
     args = parser.parse_args()
-    converter(args.input, args.output) 
+    if not args.check:
+        if args.output is None:
+            parser.error("the output file is required")
+        converter(args.input, args.output)
+    binary = args.input if args.check else args.output
+    error = validator(binary)
+    if error is not None:
+        print("%s: %s" % (binary, error))
+        exit(1)